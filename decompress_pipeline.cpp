@@ -0,0 +1,784 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "decompress_pipeline.h"
+#include "output_buffer.h"
+#include "performance_timer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define PIPELINE_HAS_IO_URING
+#endif
+#endif
+
+namespace {
+
+    //  Progress of one file through the pipeline
+    struct FileState
+    {
+        DecompressPipeline::Job* job = nullptr;
+        int in_fd = -1;
+        int out_fd = -1;
+
+        std::vector<char> input;
+        size_t read_requested = 0;
+        size_t read_done = 0;
+
+        //  Set by the worker that decompresses the file
+        OutputBuffer output;
+        int result = DeflateDecompressor::eSuccess;
+        const char* error_message = nullptr;
+
+        size_t write_requested = 0;
+        size_t write_done = 0;
+
+        //  I/O requests not completed yet
+        int in_flight = 0;
+
+        bool queued = false;
+        bool decoded = false;
+        bool failed = false;
+    };
+
+
+    struct IoRequest
+    {
+        bool write = false;
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+        uint64_t offset = 0;
+
+        //  Bytes transferred, or a negated errno value
+        ssize_t result = 0;
+
+        FileState* file = nullptr;
+        iovec iov;
+    };
+
+
+    class IoEngine
+    {
+    public:
+        virtual ~IoEngine() = default;
+
+        virtual void submit(IoRequest* request) = 0;
+
+        //  Wait for a request to complete.
+        //  Returns nullptr if woken up with wake instead.
+        virtual IoRequest* wait() = 0;
+
+        //  Make wait return. Can be called from any thread.
+        virtual void wake() = 0;
+
+        //  True if the engine broke down, and can't complete the requests
+        virtual bool failed() const { return false; }
+    };
+
+
+    //  Blocking pread and pwrite on a few threads
+    class ThreadIoEngine : public IoEngine
+    {
+    public:
+        explicit ThreadIoEngine(int thread_count)
+        {
+            for (int ix = 0; ix < thread_count; ++ix)
+            {
+                m_threads.emplace_back(&ThreadIoEngine::serve, this);
+            }
+        }
+
+        ~ThreadIoEngine() override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+
+            m_work_condition.notify_all();
+            for (std::thread& thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        void submit(IoRequest* request) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_pending.push_back(request);
+            }
+
+            m_work_condition.notify_one();
+        }
+
+        IoRequest* wait() override
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done_condition.wait(lock, [this]() { return !m_completed.empty() || m_woken; });
+            if (m_completed.empty())
+            {
+                m_woken = false;
+                return nullptr;
+            }
+
+            IoRequest* request = m_completed.front();
+            m_completed.pop_front();
+            return request;
+        }
+
+        void wake() override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_woken = true;
+            }
+
+            m_done_condition.notify_one();
+        }
+
+    private:
+        void serve()
+        {
+            for (;;)
+            {
+                IoRequest* request = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_work_condition.wait(lock, [this]() { return !m_pending.empty() || m_stopping; });
+                    if (m_stopping)
+                    {
+                        return;
+                    }
+
+                    request = m_pending.front();
+                    m_pending.pop_front();
+                }
+
+                ssize_t result;
+                do
+                {
+                    result = request->write
+                        ? ::pwrite(request->fd, request->data, request->size, off_t(request->offset))
+                        : ::pread(request->fd, request->data, request->size, off_t(request->offset));
+                }
+                while (result < 0 && errno == EINTR);
+
+                request->result = (result < 0) ? -errno : result;
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_completed.push_back(request);
+                }
+
+                m_done_condition.notify_one();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_work_condition;
+        std::condition_variable m_done_condition;
+        std::deque<IoRequest*> m_pending;
+        std::deque<IoRequest*> m_completed;
+        bool m_woken = false;
+        bool m_stopping = false;
+        std::vector<std::thread> m_threads;
+    };
+
+
+#ifdef PIPELINE_HAS_IO_URING
+
+    //  The io_uring interface through plain system calls, without liburing.
+    //  A read on an eventfd stays queued all the time, and wake writes to it.
+    class UringIoEngine : public IoEngine
+    {
+    public:
+        UringIoEngine() = default;
+
+        ~UringIoEngine() override
+        {
+            if (m_sqes)
+            {
+                ::munmap(m_sqes, m_sqes_size);
+            }
+
+            if (m_cq_ring && m_cq_ring != m_sq_ring)
+            {
+                ::munmap(m_cq_ring, m_cq_ring_size);
+            }
+
+            if (m_sq_ring)
+            {
+                ::munmap(m_sq_ring, m_sq_ring_size);
+            }
+
+            if (m_ring_fd >= 0)
+            {
+                ::close(m_ring_fd);
+            }
+
+            if (m_event_fd >= 0)
+            {
+                ::close(m_event_fd);
+            }
+        }
+
+        UringIoEngine(const UringIoEngine&) = delete;
+        UringIoEngine& operator=(const UringIoEngine&) = delete;
+
+        //  Returns false if io_uring isn't available
+        bool open(unsigned entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof params);
+            m_ring_fd = int(::syscall(__NR_io_uring_setup, entries, &params));
+            if (m_ring_fd < 0)
+            {
+                return false;
+            }
+
+            m_sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+            m_cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+            bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+            single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#endif
+            if (single_mmap)
+            {
+                m_sq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+            }
+
+            m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+            m_cq_ring = single_mmap ? m_sq_ring : map(m_cq_ring_size, IORING_OFF_CQ_RING);
+            m_sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+            m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+            if (!m_sq_ring || !m_cq_ring || !m_sqes)
+            {
+                return false;
+            }
+
+            char* sq = static_cast<char*>(m_sq_ring);
+            m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+            char* cq = static_cast<char*>(m_cq_ring);
+            m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+            m_event_fd = ::eventfd(0, EFD_CLOEXEC);
+            if (m_event_fd < 0)
+            {
+                return false;
+            }
+
+            arm_wakeup();
+            return true;
+        }
+
+        void submit(IoRequest* request) override
+        {
+            request->iov.iov_base = request->data;
+            request->iov.iov_len = request->size;
+            add(request->write ? IORING_OP_WRITEV : IORING_OP_READV,
+                request->fd, &request->iov, request->offset, reinterpret_cast<uintptr_t>(request));
+        }
+
+        IoRequest* wait() override
+        {
+            while (!m_failed)
+            {
+                //  Nobody else consumes completions, so only the tail needs care
+                unsigned head = *m_cq_head;
+                if (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+                {
+                    const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+                    uint64_t user_data = cqe.user_data;
+                    int result = cqe.res;
+                    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+                    if (user_data == wakeup_data)
+                    {
+                        arm_wakeup();
+                        return nullptr;
+                    }
+
+                    IoRequest* request = reinterpret_cast<IoRequest*>(uintptr_t(user_data));
+                    request->result = result;
+                    return request;
+                }
+
+                //  Submit what's queued, and wait for at least one completion
+                int submitted = int(::syscall(__NR_io_uring_enter,
+                    m_ring_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (submitted >= 0)
+                {
+                    m_to_submit -= unsigned(submitted);
+                }
+                else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    m_failed = true;
+                }
+            }
+
+            return nullptr;
+        }
+
+        void wake() override
+        {
+            uint64_t one = 1;
+            while (::write(m_event_fd, &one, sizeof one) < 0 && errno == EINTR)
+            {
+            }
+        }
+
+        bool failed() const override { return m_failed; }
+
+    private:
+        static constexpr uint64_t wakeup_data = 0;
+
+        void* map(size_t size, off_t offset)
+        {
+            void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, offset);
+            return (ptr == MAP_FAILED) ? nullptr : ptr;
+        }
+
+        //  The pipeline keeps fewer requests in flight than the ring has
+        //  entries, so there's always a free submission queue entry.
+        void add(int opcode, int fd, iovec* iov, uint64_t offset, uint64_t user_data)
+        {
+            unsigned tail = *m_sq_tail;
+            unsigned index = tail & *m_sq_mask;
+            io_uring_sqe& sqe = m_sqes[index];
+            std::memset(&sqe, 0, sizeof sqe);
+            sqe.opcode = uint8_t(opcode);
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<uintptr_t>(iov);
+            sqe.len = 1;
+            sqe.user_data = user_data;
+            m_sq_array[index] = index;
+            __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++m_to_submit;
+        }
+
+        void arm_wakeup()
+        {
+            m_event_iov.iov_base = &m_event_value;
+            m_event_iov.iov_len = sizeof m_event_value;
+            add(IORING_OP_READV, m_event_fd, &m_event_iov, 0, wakeup_data);
+        }
+
+        int m_ring_fd = -1;
+        int m_event_fd = -1;
+        bool m_failed = false;
+
+        void* m_sq_ring = nullptr;
+        void* m_cq_ring = nullptr;
+        size_t m_sq_ring_size = 0;
+        size_t m_cq_ring_size = 0;
+        io_uring_sqe* m_sqes = nullptr;
+        size_t m_sqes_size = 0;
+
+        unsigned* m_sq_tail = nullptr;
+        unsigned* m_sq_mask = nullptr;
+        unsigned* m_sq_array = nullptr;
+        unsigned* m_cq_head = nullptr;
+        unsigned* m_cq_tail = nullptr;
+        unsigned* m_cq_mask = nullptr;
+        io_uring_cqe* m_cqes = nullptr;
+
+        unsigned m_to_submit = 0;
+        uint64_t m_event_value = 0;
+        iovec m_event_iov;
+    };
+
+#endif
+
+
+    //  Workers decompressing whole files in memory
+    class WorkerPool
+    {
+    public:
+        WorkerPool(int worker_count, IoEngine& engine)
+            : m_engine(engine)
+        {
+            for (int ix = 0; ix < worker_count; ++ix)
+            {
+                m_threads.emplace_back(&WorkerPool::work, this);
+            }
+        }
+
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+
+            m_condition.notify_all();
+            for (std::thread& thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        void add(FileState* file)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_queue.push_back(file);
+            }
+
+            m_condition.notify_one();
+        }
+
+        //  A decompressed file, or nullptr if none are ready
+        FileState* take_done()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_done.empty())
+            {
+                return nullptr;
+            }
+
+            FileState* file = m_done.front();
+            m_done.pop_front();
+            return file;
+        }
+
+    private:
+        void work()
+        {
+            for (;;)
+            {
+                FileState* file = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_condition.wait(lock, [this]() { return !m_queue.empty() || m_stopping; });
+                    if (m_stopping)
+                    {
+                        return;
+                    }
+
+                    file = m_queue.front();
+                    m_queue.pop_front();
+                }
+
+                DeflateDecompressor& deflate = DeflateDecompressor::thread_instance();
+                file->result = deflate.decompress(file->input.data(), file->input.size(), file->output);
+                file->error_message = deflate.error_message();
+                std::vector<char>().swap(file->input);
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_done.push_back(file);
+                }
+
+                m_engine.wake();
+            }
+        }
+
+        IoEngine& m_engine;
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::deque<FileState*> m_queue;
+        std::deque<FileState*> m_done;
+        bool m_stopping = false;
+        std::vector<std::thread> m_threads;
+    };
+
+
+    void fail(FileState& file, int result, const char* message)
+    {
+        if (!file.failed)
+        {
+            file.failed = true;
+            file.job->result = result;
+            file.job->error_message = message;
+        }
+    }
+
+
+    std::unique_ptr<FileState> open_input(DecompressPipeline::Job& job)
+    {
+        std::unique_ptr<FileState> file(new FileState);
+        file->job = &job;
+        file->in_fd = ::open(job.input_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        struct stat info;
+        if (file->in_fd < 0 || ::fstat(file->in_fd, &info) != 0)
+        {
+            fail(*file, DeflateDecompressor::eInvalidInput, "Can't open the input file");
+            return file;
+        }
+
+        file->input.resize(size_t(info.st_size));
+        return file;
+    }
+
+
+    void close_files(FileState& file)
+    {
+        if (file.in_fd >= 0)
+        {
+            ::close(file.in_fd);
+        }
+
+        if (file.out_fd >= 0 && ::close(file.out_fd) != 0)
+        {
+            fail(file, DeflateDecompressor::eOutputError, "Writing the output file failed");
+        }
+
+        file.in_fd = -1;
+        file.out_fd = -1;
+    }
+
+} // namespace
+
+
+double DecompressPipeline::Statistics::output_gb_per_second() const
+{
+    if (elapsed_microseconds <= 0)
+    {
+        return 0;
+    }
+
+    return double(output_bytes) / double(elapsed_microseconds) / 1000.0;
+}
+
+
+bool DecompressPipeline::run(std::vector<Job>& jobs)
+{
+    m_statistics = Statistics();
+    int64_t start_time = PerformanceTimer::get_timestamp();
+
+    int worker_count = m_options.worker_count;
+    if (worker_count <= 0)
+    {
+        worker_count = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+
+    int max_reads = std::max(1, m_options.reads_in_flight);
+    int max_writes = std::max(1, m_options.writes_in_flight);
+    size_t io_size = std::max<size_t>(m_options.io_size, 4096);
+    size_t max_files = size_t(m_options.files_in_flight > 0 ? m_options.files_in_flight : worker_count + 2);
+
+    //  Destroyed in reverse order: the workers are stopped first, and the
+    //  file buffers stay around until nothing can refer to them any more.
+    std::vector<std::unique_ptr<FileState>> active;
+    std::unique_ptr<IoEngine> engine;
+#ifdef PIPELINE_HAS_IO_URING
+    if (m_options.use_io_uring)
+    {
+        //  One more entry for the wakeup read
+        std::unique_ptr<UringIoEngine> uring(new UringIoEngine);
+        if (uring->open(unsigned(max_reads + max_writes + 1)))
+        {
+            engine = std::move(uring);
+            m_statistics.used_io_uring = true;
+        }
+    }
+#endif
+    if (!engine)
+    {
+        engine.reset(new ThreadIoEngine(max_reads + max_writes));
+    }
+
+    std::vector<IoRequest> requests(max_reads + max_writes);
+    std::vector<IoRequest*> free_requests;
+    for (IoRequest& request : requests)
+    {
+        free_requests.push_back(&request);
+    }
+
+    int reads_active = 0;
+    int writes_active = 0;
+    auto submit = [&](FileState& file, bool write, char* data, size_t size, uint64_t offset)
+    {
+        IoRequest* request = free_requests.back();
+        free_requests.pop_back();
+        request->write = write;
+        request->fd = write ? file.out_fd : file.in_fd;
+        request->data = data;
+        request->size = size;
+        request->offset = offset;
+        request->file = &file;
+        ++file.in_flight;
+        ++(write ? writes_active : reads_active);
+        engine->submit(request);
+    };
+
+    WorkerPool workers(worker_count, *engine);
+    size_t next_job = 0;
+    bool all_ok = true;
+
+    for (;;)
+    {
+        while (active.size() < max_files && next_job < jobs.size())
+        {
+            active.push_back(open_input(jobs[next_job++]));
+        }
+
+        for (std::unique_ptr<FileState>& file : active)
+        {
+            while (!file->failed && reads_active < max_reads && file->read_requested < file->input.size())
+            {
+                size_t size = std::min(io_size, file->input.size() - file->read_requested);
+                submit(*file, false, file->input.data() + file->read_requested, size, file->read_requested);
+                file->read_requested += size;
+            }
+
+            if (!file->failed && !file->queued && file->read_done == file->input.size())
+            {
+                file->queued = true;
+                workers.add(file.get());
+            }
+
+            while (!file->failed && file->decoded && writes_active < max_writes
+                && file->write_requested < file->output.size())
+            {
+                size_t size = std::min(io_size, file->output.size() - file->write_requested);
+                submit(*file, true, file->output.data() + file->write_requested, size, file->write_requested);
+                file->write_requested += size;
+            }
+        }
+
+        //  Retire the files that are completely done
+        for (size_t ix = 0; ix < active.size(); )
+        {
+            FileState& file = *active[ix];
+            bool busy = file.in_flight || (file.queued && !file.decoded);
+            bool written = file.decoded && file.write_done == file.output.size();
+            if (busy || (!file.failed && !written))
+            {
+                ++ix;
+                continue;
+            }
+
+            close_files(file);
+            if (file.failed)
+            {
+                all_ok = false;
+            }
+            else
+            {
+                file.job->result = DeflateDecompressor::eSuccess;
+                file.job->error_message = nullptr;
+                file.job->output_size = file.output.size();
+                m_statistics.output_bytes += file.output.size();
+            }
+
+            active.erase(active.begin() + ix);
+        }
+
+        if (active.empty() && next_job == jobs.size())
+        {
+            break;
+        }
+
+        if (engine->failed())
+        {
+            //  Nothing more can complete, so give up
+            for (std::unique_ptr<FileState>& file : active)
+            {
+                fail(*file, DeflateDecompressor::eOutputError, "Asynchronous I/O failed");
+            }
+
+            for (size_t ix = next_job; ix < jobs.size(); ++ix)
+            {
+                jobs[ix].result = DeflateDecompressor::eOutputError;
+                jobs[ix].error_message = "Asynchronous I/O failed";
+            }
+
+            for (std::unique_ptr<FileState>& file : active)
+            {
+                close_files(*file);
+            }
+
+            all_ok = false;
+            break;
+        }
+
+        if (IoRequest* request = engine->wait())
+        {
+            FileState& file = *request->file;
+            --file.in_flight;
+            --(request->write ? writes_active : reads_active);
+
+            if (request->result <= 0)
+            {
+                fail(file, request->write ? DeflateDecompressor::eOutputError : DeflateDecompressor::eInvalidInput,
+                    request->write ? "Writing the output file failed" : "Reading the input file failed");
+                free_requests.push_back(request);
+                continue;
+            }
+
+            //  Count what got transferred, whether all of it or not
+            size_t done = std::min(size_t(request->result), request->size);
+            if (request->write)
+            {
+                file.write_done += done;
+            }
+            else
+            {
+                file.read_done += done;
+                m_statistics.input_bytes += done;
+            }
+
+            if (done < request->size)
+            {
+                //  A short transfer, continue from where it stopped
+                ++file.in_flight;
+                ++(request->write ? writes_active : reads_active);
+                request->data += done;
+                request->size -= done;
+                request->offset += done;
+                engine->submit(request);
+                continue;
+            }
+
+            free_requests.push_back(request);
+        }
+
+        while (FileState* file = workers.take_done())
+        {
+            file->decoded = true;
+            if (file->result != DeflateDecompressor::eSuccess)
+            {
+                fail(*file, file->result, file->error_message);
+                continue;
+            }
+
+            file->out_fd = ::open(file->job->output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (file->out_fd < 0)
+            {
+                fail(*file, DeflateDecompressor::eOutputError, "Can't create the output file");
+            }
+        }
+    }
+
+    m_statistics.elapsed_microseconds = PerformanceTimer::get_elapsed_time(start_time);
+    return all_ok;
+}
@@ -0,0 +1,77 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+#include <string>
+#include <vector>
+
+//  Decompress a batch of files with reading, decoding, and writing overlapped.
+//
+//  One thread drives the I/O, keeping several reads and writes in flight at
+//  once. A file is decompressed in memory by a pool of workers as soon as all
+//  of it has been read, and written out as soon as it's done. The I/O goes
+//  through io_uring when the kernel supports it, and through a few threads
+//  doing pread and pwrite otherwise.
+//
+//  Available on Linux only.
+//
+class DecompressPipeline
+{
+public:
+    struct Options
+    {
+        //  Zero means one per hardware thread
+        int worker_count = 0;
+
+        //  Reads and writes kept in flight, each at most io_size bytes
+        int reads_in_flight = 8;
+        int writes_in_flight = 8;
+        size_t io_size = 1024*1024;
+
+        //  Files being read, decoded, or written at the same time.
+        //  Zero means a few more than the workers.
+        int files_in_flight = 0;
+
+        //  Use the thread based I/O even if io_uring is available
+        bool use_io_uring = true;
+    };
+
+    struct Job
+    {
+        std::string input_path;
+        std::string output_path;
+
+        //  Results: a DeflateDecompressor error code, and the message for it
+        int result = -1;
+        const char* error_message = nullptr;
+        uint64_t output_size = 0;
+    };
+
+    struct Statistics
+    {
+        uint64_t input_bytes = 0;
+        uint64_t output_bytes = 0;
+        int64_t elapsed_microseconds = 0;
+        bool used_io_uring = false;
+
+        //  Aggregate throughput, in decompressed gigabytes per second
+        double output_gb_per_second() const;
+    };
+
+    DecompressPipeline() = default;
+    explicit DecompressPipeline(const Options& options) : m_options(options) {}
+
+    //  Process all the jobs. Returns true if every one of them succeeded.
+    bool run(std::vector<Job>& jobs);
+
+    //  Available after run
+    const Statistics& statistics() const { return m_statistics; }
+
+private:
+    Options m_options;
+    Statistics m_statistics;
+};
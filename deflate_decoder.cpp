@@ -0,0 +1,103 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "deflate_decoder.h"
+
+
+template <typename Call>
+DeflateDecoder::Result DeflateDecoder::run(Call call) const
+{
+    DeflateDecompressor context;
+    context.set_trailing_data_allowed(m_trailing_data_allowed);
+    context.set_size_hint_policy(m_size_hint_policy);
+
+    Result result;
+    result.status = call(context);
+    result.error_message = context.error_message();
+    result.input_consumed = result.status ? 0 : context.input_consumed();
+    result.output_truncated = context.output_truncated();
+    return result;
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress(const char* input, size_t size, std::vector<char>& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress(input, size, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress(const char* input, size_t size, DeflateDecompressor::Output& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress(input, size, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress(DeflateDecompressor::Input& input, DeflateDecompressor::Output& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress(input, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress(
+    const DeflateDecompressor::Span* spans, size_t count, std::vector<char>& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress(spans, count, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress(
+    const DeflateDecompressor::Span* spans, size_t count, DeflateDecompressor::Output& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress(spans, count, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::verify(const char* input, size_t size) const
+{
+    return run([&](DeflateDecompressor& context) { return context.verify(input, size); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::verify(DeflateDecompressor::Input& input) const
+{
+    return run([&](DeflateDecompressor& context) { return context.verify(input); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress_prefix(
+    const char* input, size_t size, size_t max_output, std::vector<char>& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress_prefix(input, size, max_output, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress_prefix(
+    const char* input, size_t size, size_t max_output, DeflateDecompressor::Output& out) const
+{
+    return run([&](DeflateDecompressor& context) { return context.decompress_prefix(input, size, max_output, out); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::decompress_range(
+    const char* input, size_t size, uint64_t offset, size_t max_output, std::vector<char>& out) const
+{
+    return run([&](DeflateDecompressor& context)
+    {
+        return context.decompress_range(input, size, offset, max_output, out);
+    });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::tokenize(
+    const char* input, size_t size, DeflateDecompressor::TokenConsumer& consumer) const
+{
+    return run([&](DeflateDecompressor& context) { return context.tokenize(input, size, consumer); });
+}
+
+
+DeflateDecoder::Result DeflateDecoder::tokenize(
+    DeflateDecompressor::Input& input, DeflateDecompressor::TokenConsumer& consumer) const
+{
+    return run([&](DeflateDecompressor& context) { return context.tokenize(input, consumer); });
+}
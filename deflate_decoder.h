@@ -0,0 +1,72 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+//  A convenience facade for decompressing from any number of threads,
+//  with one shared object and no locking.
+//
+//  The object only holds settings, which don't change once it's in use.
+//  Every call constructs a DeflateDecompressor of its own on the stack,
+//  runs it, and returns what it reported in a Result. That takes about
+//  8 KiB of stack, mostly decode tables, which are left uninitialized
+//  until a block needs them. The tables of the static Huffman code are
+//  built once and shared by all.
+//
+//  Nothing is carried over from one call to the next: there's no table
+//  cache and no learned output size ratio. verify and tokenize allocate
+//  their buffers on every call.
+//
+class DeflateDecoder
+{
+public:
+    struct Result
+    {
+        //  One of the DeflateDecompressor return codes
+        int status = DeflateDecompressor::eSuccess;
+
+        //  A brief description of the error, nullptr if there was none
+        const char* error_message = nullptr;
+
+        //  Same as DeflateDecompressor::input_consumed, valid on success
+        uint64_t input_consumed = 0;
+
+        //  Same as DeflateDecompressor::output_truncated
+        bool output_truncated = false;
+
+        bool ok() const { return status == DeflateDecompressor::eSuccess; }
+    };
+
+    //  Settings, as for DeflateDecompressor. Not to be changed while other
+    //  threads are using the decoder.
+    void set_trailing_data_allowed(bool allowed) { m_trailing_data_allowed = allowed; }
+    void set_size_hint_policy(const DeflateDecompressor::SizeHintPolicy& policy) { m_size_hint_policy = policy; }
+
+    //  The same as the DeflateDecompressor functions of the same names
+    Result decompress(const char* input, size_t size, std::vector<char>& out) const;
+    Result decompress(const char* input, size_t size, DeflateDecompressor::Output& out) const;
+    Result decompress(DeflateDecompressor::Input& input, DeflateDecompressor::Output& out) const;
+    Result decompress(const DeflateDecompressor::Span* spans, size_t count, std::vector<char>& out) const;
+    Result decompress(const DeflateDecompressor::Span* spans, size_t count, DeflateDecompressor::Output& out) const;
+
+    Result verify(const char* input, size_t size) const;
+    Result verify(DeflateDecompressor::Input& input) const;
+
+    Result decompress_prefix(const char* input, size_t size, size_t max_output, std::vector<char>& out) const;
+    Result decompress_prefix(const char* input, size_t size, size_t max_output, DeflateDecompressor::Output& out) const;
+    Result decompress_range(const char* input, size_t size, uint64_t offset, size_t max_output, std::vector<char>& out) const;
+
+    Result tokenize(const char* input, size_t size, DeflateDecompressor::TokenConsumer& consumer) const;
+    Result tokenize(DeflateDecompressor::Input& input, DeflateDecompressor::TokenConsumer& consumer) const;
+
+private:
+    //  Run one call with a decompressor of its own
+    template <typename Call>
+    Result run(Call call) const;
+
+    bool m_trailing_data_allowed = false;
+    DeflateDecompressor::SizeHintPolicy m_size_hint_policy;
+};
@@ -48,22 +48,89 @@ namespace {
     constexpr int max_distance_codewords = 32;
     constexpr int max_possible_codewords = max_literal_length_codewords;
 
+    //  Literals are the symbols before it, lengths the ones after it
+    constexpr int end_of_block = 256;
+
     constexpr int code_length_table_bits = 7;
     constexpr int literal_length_table_bits = 10;
     constexpr int distance_table_bits = 8;
 
-    constexpr int lengths_array_size = max_literal_length_codewords + max_distance_codewords;
+    constexpr unsigned literal_length_table_mask = (1 << literal_length_table_bits) - 1;
+    constexpr unsigned distance_table_mask = (1 << distance_table_bits) - 1;
 
-    constexpr unsigned subtable_flag = 0x80;
-    constexpr unsigned literal_flag = 0x40;
-    constexpr unsigned extra_mask = 0x3f;
-    constexpr unsigned data_shift = 8;
+    constexpr int lengths_array_size = max_literal_length_codewords + max_distance_codewords;
 
-    constexpr unsigned invalid_codeword = 0xff;
+    //  Number of table sets kept in the cache
+    constexpr int table_cache_size = 4;
+
+    //  Decode table entries:
+    //    bits 0-4    Bits to consume, the codeword and the extra bits after it.
+    //                In a link to a subtable, the number of subtable index bits.
+    //    bits 8-11   Codeword length, where the extra bits start
+    //    bit 14      Literal
+    //    bit 15      Link to a subtable
+    //    bits 16-31  Literal value, base length or distance, or subtable offset
+    //  End of block has neither flag and a zero value.
+    //  A length or a distance is then the base plus one shift and mask of
+    //  the bit buffer, with no separate read of the extra bits.
+    constexpr unsigned total_bits_mask = 0x1f;
+    constexpr unsigned codeword_length_shift = 8;
+    constexpr unsigned codeword_length_mask = 0xf;
+    constexpr unsigned literal_flag = 0x4000;
+    constexpr unsigned subtable_flag = 0x8000;
+    constexpr unsigned data_shift = 16;
+
+    constexpr uint32_t invalid_codeword = 0xffffffff;
+
+    //  The most bits a literal or length, and a distance, can take with their extra bits
+    constexpr int max_length_code_bits = 15 + 5;
+    constexpr int max_distance_code_bits = 15 + 13;
+
+    //  Back-references reach at most this far back
+    constexpr size_t window_size = 32*1024;
+
+    //  The longest possible match
+    constexpr ptrdiff_t max_match_length = 258;
+
+    //  Smallest output buffer worth allocating
+    constexpr size_t min_output_size = 16*1024;
+
+    //  LZ77 tokens are passed in batches of this size.
+    //  The token format is in the header.
+    constexpr int tokens_per_batch = 16*1024;
+    constexpr int literals_per_batch = 64*1024;
+    constexpr uint32_t literal_run_flag = 0x80000000;
+    constexpr uint32_t block_flag = 0x40000000;
+
+    //  Number of codeword lengths after a block token
+    inline int block_lengths_count(uint32_t token)
+    {
+        return ((token >> 8) & 0x1ff) + ((token >> 17) & 0x3f);
+    }
 
     constexpr uint32_t pack(unsigned data) { return data << data_shift; }
     constexpr uint32_t literal(unsigned data) { return pack(data) | literal_flag; }
-    constexpr uint32_t pack2(unsigned data, unsigned extra) { return pack(pack(data) | extra); }
+    constexpr uint32_t pack2(unsigned data, unsigned extra) { return pack(data) | extra; }
+
+    //  The table entry of a symbol with a codeword of the given length.
+    //  The values of the symbols already hold the number of extra bits.
+    //  Symbols that can't appear in valid data stay invalid.
+    constexpr uint32_t add_codeword_length(uint32_t value, int length)
+    {
+        if (value == invalid_codeword)
+        {
+            return invalid_codeword;
+        }
+
+        return value + length + (length << codeword_length_shift);
+    }
+
+    //  Base plus the extra bits of an entry, from the bits it was looked up with
+    inline unsigned entry_value(uint32_t entry, uint64_t bits)
+    {
+        uint64_t mask = ~(~uint64_t(0) << (entry & total_bits_mask));
+        return (entry >> data_shift) + unsigned((bits & mask) >> ((entry >> codeword_length_shift) & codeword_length_mask));
+    }
 
     static const uint32_t code_length_values[max_code_length_codewords] = {
         pack(0), pack(1), pack(2), pack(3), pack(4), pack(5), pack(6),
@@ -133,39 +200,195 @@ namespace {
         pack2(163, 5), pack2(195, 5), pack2(227, 5), pack2(258, 0), pack2(258, 0), pack2(258, 0),
     };
 
+    //  Distance codes 30 and 31 can have a codeword, but would reach past 32 KiB
     static const uint32_t distance_values[max_distance_codewords] = {
         pack2(1, 0), pack2(2, 0), pack2(3, 0), pack2(4, 0), pack2(5, 1), pack2(7, 1),
         pack2(9, 2), pack2(13, 2), pack2(17, 3), pack2(25, 3), pack2(33, 4), pack2(49, 4),
         pack2(65, 5), pack2(97, 5), pack2(129, 6), pack2(193, 6), pack2(257, 7),
         pack2(385, 7), pack2(513, 8), pack2(769, 8), pack2(1025, 9), pack2(1537, 9),
         pack2(2049, 10), pack2(3073, 10), pack2(4097, 11), pack2(6145, 11), pack2(8193, 12),
-        pack2(12289, 12), pack2(16385, 13), pack2(24577, 13), pack2(32769, 14), pack2(49153, 14),
+        pack2(12289, 12), pack2(16385, 13), pack2(24577, 13), invalid_codeword, invalid_codeword,
+    };
+
+
+    //  Bit reversed values for all bytes
+    struct BitReverseTable
+    {
+        uint8_t values[256] = {};
+
+        constexpr BitReverseTable()
+        {
+            for (int ix = 0; ix < 256; ++ix)
+            {
+                unsigned reversed = 0;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    if (ix & (1 << bit))
+                    {
+                        reversed |= 0x80 >> bit;
+                    }
+                }
+
+                values[ix] = uint8_t(reversed);
+            }
+        }
+    };
+
+    constexpr BitReverseTable bit_reverse_table;
+
+
+    //  Reverse the bits of a codeword of a given length
+    inline unsigned reverse_bits(unsigned codeword, int length)
+    {
+        const uint8_t* reversed = bit_reverse_table.values;
+        unsigned result = (reversed[codeword & 0xff] << 8) | reversed[(codeword >> 8) & 0xff];
+        return result >> (16 - length);
+    }
+
+
+    //  The codeword lengths of an alphabet, with the symbols
+    //  arranged by length, and by symbol order within the same length.
+    struct SortedCodewords
+    {
+        int length_counts[max_possibe_codeword_length + 1];
+        uint16_t symbols[max_possible_codewords];
+
+        //  Symbols with zero length are skipped
+        const uint16_t* used_symbols() const { return symbols + length_counts[0]; }
+
+        int longest_length() const
+        {
+            int length = max_possibe_codeword_length;
+            while (length && length_counts[length] == 0)
+            {
+                --length;
+            }
+
+            return length;
+        }
     };
 
 
-    //  Increment a bit reversed codeword of a given length
-    unsigned bit_reversed_increment(unsigned codeword, int length)
+    //  True if the eight lengths starting at ptr are all zero
+    inline bool eight_unused(const uint8_t* ptr)
+    {
+        uint64_t word;
+        std::memcpy(&word, ptr, sizeof word);
+        return word == 0;
+    }
+
+
+    //  Sort the symbols of two alphabets by codeword length. Their lengths
+    //  are back to back, like the literal/length and distance lengths of a
+    //  dynamic block, and get one counting pass and one placement pass.
+    //  The second alphabet may be empty, and then 'second' may be null.
+    void sort_codewords(const uint8_t* codeword_lengths, int first_size, int second_size,
+        SortedCodewords* first, SortedCodewords* second)
     {
-        unsigned result = 0;
-        unsigned bit = 1 << (length - 1);
-        while (codeword & bit)
+        //  Unused symbols tend to come in long runs, like most of the
+        //  literals in a text file. Runs of eight are skipped at once,
+        //  and the rest are counted into two separate histograms per
+        //  alphabet so that an increment seldom has to wait for the previous one.
+        constexpr int histogram_size = max_possibe_codeword_length + 1;
+        int counts[2][2][histogram_size];
+        std::memset(counts, 0, sizeof counts);
+
+        const int number_of_symbols = first_size + second_size;
+        const int whole_words_end = number_of_symbols & ~7;
+        int symbol = 0;
+        for (; symbol < whole_words_end; symbol += 8)
         {
-            bit >>= 1;
+            const uint8_t* lengths = codeword_lengths + symbol;
+            if (eight_unused(lengths))
+            {
+                continue;
+            }
+
+            //  The eight that straddle the two alphabets go one at a time
+            if (symbol < first_size && symbol + 8 > first_size)
+            {
+                for (int ix = 0; ix < 8; ++ix)
+                {
+                    counts[symbol + ix >= first_size][ix & 1][lengths[ix]]++;
+                }
+
+                continue;
+            }
+
+            int (*alphabet_counts)[histogram_size] = counts[symbol >= first_size];
+            for (int ix = 0; ix < 8; ix += 2)
+            {
+                alphabet_counts[0][lengths[ix]]++;
+                alphabet_counts[1][lengths[ix + 1]]++;
+            }
         }
 
-        if (bit != 0)
+        for (; symbol < number_of_symbols; ++symbol)
         {
-            result = codeword & (bit - 1);
-            result |= bit;
+            counts[symbol >= first_size][0][codeword_lengths[symbol]]++;
         }
 
-        return result;
+        SortedCodewords* sorted[2] = { first, second };
+        const int sizes[2] = { first_size, second_size };
+        int offsets[2][histogram_size];
+        for (int alphabet = 0; alphabet < 2 && sorted[alphabet]; ++alphabet)
+        {
+            int* length_counts = sorted[alphabet]->length_counts;
+            int used_count = 0;
+            for (int length = 1; length < histogram_size; ++length)
+            {
+                length_counts[length] = counts[alphabet][0][length] + counts[alphabet][1][length];
+                used_count += length_counts[length];
+            }
+
+            length_counts[0] = sizes[alphabet] - used_count;
+
+            int* alphabet_offsets = offsets[alphabet];
+            alphabet_offsets[0] = 0;
+            alphabet_offsets[1] = length_counts[0];
+            for (int length = 1; length < max_possibe_codeword_length; ++length)
+            {
+                alphabet_offsets[length + 1] = alphabet_offsets[length] + length_counts[length];
+            }
+        }
+
+        //  Only the used symbols go to the sorted arrays, numbered within their
+        //  alphabet. The sweep goes on from one alphabet to the next.
+        int begin = 0;
+        for (int alphabet = 0; alphabet < 2 && sorted[alphabet]; ++alphabet)
+        {
+            int end = begin + sizes[alphabet];
+            uint16_t* symbols = sorted[alphabet]->symbols;
+            int* alphabet_offsets = offsets[alphabet];
+            for (symbol = begin; symbol < end; ++symbol)
+            {
+                if ((symbol & 7) == 0 && symbol < whole_words_end && eight_unused(codeword_lengths + symbol))
+                {
+                    symbol += 7;
+                    continue;
+                }
+
+                int length = codeword_lengths[symbol];
+                if (length)
+                {
+                    symbols[alphabet_offsets[length]++] = uint16_t(symbol - begin);
+                }
+            }
+
+            begin = end;
+        }
     }
 
 
     //  Fill words of the decode table with a given value.
     void fill_decode_table(uint32_t* table, int size, uint32_t value, int stride)
     {
+        if (stride == 1)
+        {
+            std::fill_n(table, size, value);
+            return;
+        }
+
         for (int ix = 0; ix < size; ix += stride)
         {
             table[ix] = value;
@@ -184,27 +407,13 @@ namespace {
     bool build_decode_table(
         uint32_t* decode_table,
         const int table_bits,
-        const uint8_t* codeword_lengths,
-        const uint32_t* symbol_values,
-        const int number_of_symbols)
+        const SortedCodewords& sorted,
+        const uint32_t* symbol_values)
     {
-        unsigned symbols_array[max_possible_codewords];
-        unsigned* symbols = symbols_array;
-
-        //  Number of codewords with each length
-        int length_counts[max_possibe_codeword_length + 1];
-        std::memset(length_counts, 0, sizeof length_counts);
-        for (int symbol = 0; symbol < number_of_symbols; symbol++)
-        {
-            length_counts[codeword_lengths[symbol]]++;
-        }
+        const int* length_counts = sorted.length_counts;
+        const uint16_t* symbols = sorted.used_symbols();
 
-        //  Find length of the longest codeword present
-        int longest_codeword_length = max_possibe_codeword_length;
-        while (longest_codeword_length && length_counts[longest_codeword_length] == 0)
-        {
-            --longest_codeword_length;
-        }
+        int longest_codeword_length = sorted.longest_length();
 
         //  No symbols defined
         if (longest_codeword_length == 0)
@@ -236,36 +445,17 @@ namespace {
             {
                 int size = 1 << table_bits;
 
-                //  Mark codeword "0" as invalid
-                fill_decode_table(decode_table, size, invalid_codeword, 2);
-
-                //  Add codeword "1" with the given value
-                uint32_t entry = symbol_values[1] | 1;
-                fill_decode_table(decode_table+1, size-1, entry, 2);
+                //  The symbol gets codeword "0", as in canonical order,
+                //  and codeword "1" is invalid. That's what zlib does too.
+                uint32_t entry = add_codeword_length(symbol_values[symbols[0]], 1);
+                fill_decode_table(decode_table, size, entry, 2);
+                fill_decode_table(decode_table+1, size-1, invalid_codeword, 2);
                 return true;
             }
 
             return false;
         }
 
-        //  Compute offsets into the table for each codeword length
-        int offsets[max_possibe_codeword_length + 1];
-        offsets[0] = 0;
-        offsets[1] = length_counts[0];
-        for (int length = 1; length < longest_codeword_length; ++length)
-        {
-            offsets[length + 1] = offsets[length] + length_counts[length];
-        }
-
-        //  Arrange symbols by length, and by symbol order within the same length
-        for (int symbol = 0; symbol < number_of_symbols; ++symbol)
-        {
-            symbols[offsets[codeword_lengths[symbol]]++] = symbol;
-        }
-
-        //  Skip past unused symbols
-        symbols += offsets[0];
-
         //  Find length of the shortest defined codeword
         int codeword_length = 1;
         while (length_counts[codeword_length] == 0)
@@ -273,69 +463,70 @@ namespace {
             ++codeword_length;
         }
 
-        int count = length_counts[codeword_length];
-        int end_index = 1 << codeword_length;
-
-        //  Add all the codewords that don't need extra tables
+        //  Codewords are assigned in canonical order, and stored bit reversed
+        //  because that's the order they come out of the input.
+        //  Entries for the codewords of each length go into the first 2^length
+        //  words of the table, and the table is doubled with a plain memcpy when
+        //  moving on to the next length. That replicates the shorter codewords
+        //  into every slot they cover with wide stores.
         unsigned codeword = 0;
-        while (codeword_length <= table_bits)
+        int end_index = 1 << codeword_length;
+        const int main_table_length = std::min(longest_codeword_length, table_bits);
+        for (;;)
         {
-            unsigned all_ones = end_index-1;
-
-            //  Add all codewords with the current length
+            int count = length_counts[codeword_length];
             while (count--)
             {
-                decode_table[codeword] = symbol_values[*symbols++] | codeword_length;
+                uint32_t entry = add_codeword_length(symbol_values[*symbols++], codeword_length);
+                decode_table[reverse_bits(codeword++, codeword_length)] = entry;
+            }
 
-                //  The last codeword is all ones
-                if (codeword == all_ones)
-                {
-                    //  Expand the decode table up to the full size
-                    while (codeword_length < table_bits)
-                    {
-                        double_the_decode_table(decode_table, end_index);
-                        end_index *= 2;
-                        ++codeword_length;
-                    }
+            if (codeword_length == main_table_length)
+            {
+                break;
+            }
 
-                    //  This is the normal exit if no subtables are required.
-                    return true;  // OK exit
-                }
+            double_the_decode_table(decode_table, end_index);
+            end_index *= 2;
+            codeword <<= 1;
+            ++codeword_length;
+        }
 
-                codeword = bit_reversed_increment(codeword, codeword_length);
-            };
+        //  Expand the decode table up to the full size
+        while (end_index < (1 << table_bits))
+        {
+            double_the_decode_table(decode_table, end_index);
+            end_index *= 2;
+        }
 
-            //  Proceed to next length, skipping lengths without any symbols
-            for (;;)
-            {
-                ++codeword_length;
-                if (codeword_length <= table_bits)
-                {
-                    double_the_decode_table(decode_table, end_index);
-                    end_index *= 2;
-                }
+        //  This is the normal exit if no subtables are required.
+        if (longest_codeword_length <= table_bits)
+        {
+            return true;
+        }
 
-                count = length_counts[codeword_length];
-                if (count)
-                {
-                    break;
-                }
-            };
+        //  Proceed to the next length present
+        int count = 0;
+        while (!count)
+        {
+            codeword <<= 1;
+            ++codeword_length;
+            count = length_counts[codeword_length];
         }
 
         //  Add the codewords that require subtables
-        end_index = 1 << table_bits;
-        unsigned prefix = end_index;
         unsigned prefix_mask = end_index - 1;
+        unsigned prefix = ~prefix_mask;
         int begin_index = 0;
         int subtable_size = 0;
         for (;;)
         {
             //  Number of extra bits needed in addition to the table bits
             int extra_bits = codeword_length - table_bits;
+            unsigned reversed = reverse_bits(codeword, codeword_length);
 
             //  If there's a new prefix, begin a new subtable
-            unsigned next_prefix = codeword & prefix_mask;
+            unsigned next_prefix = reversed & prefix_mask;
             if (next_prefix != prefix)
             {
                 prefix = next_prefix;
@@ -361,216 +552,1260 @@ namespace {
             }
 
             //  Fill subtable entries for the current codeword.
-            uint32_t* subtable = decode_table + begin_index;
-            uint32_t entry = symbol_values[*symbols++] | extra_bits;
-            const int stride = 1 << extra_bits;
-            for (int ix = codeword >> table_bits; ix < subtable_size; ix += stride)
-            {
-                subtable[ix] = entry;
-            };
+            uint32_t entry = add_codeword_length(symbol_values[*symbols++], extra_bits);
+            int first = reversed >> table_bits;
+            fill_decode_table(decode_table + begin_index + first, subtable_size - first, entry, 1 << extra_bits);
 
-            //  The last codeword is all ones
-            unsigned all_ones = (1 << codeword_length) - 1;
-            if (codeword == all_ones)
-            {
-                //  This is the normal exit if subtables were needed.
-                return true;  // OK exit
-            }
-
-            //  Advance to the next codeword
-            codeword = bit_reversed_increment(codeword, codeword_length);
-
-            //  Reduce the remaing count of codewords with this length
-            --count;
+            ++codeword;
 
             //  If the count went to zero, advance to the next length present
+            --count;
             while (!count)
             {
-                //  This isn't an infinite loop, even though it looks like one.
-                //  The "all_ones" condition gets triggered if no codewords with longer
-                //  lengths exist, so a nonzero count is guaranteed to be found.
+                //  All done after the longest codewords
+                if (codeword_length == longest_codeword_length)
+                {
+                    //  This is the normal exit if subtables were needed.
+                    return true;  // OK exit
+                }
+
+                codeword <<= 1;
                 ++codeword_length;
                 count = length_counts[codeword_length];
             }
         }
-
-        //  Should never happen
-        return false;
     }
 
 
-    uint32_t get_little_endian_uint32(const unsigned char* ptr)
+    //  Hash for a set of codeword lengths.
+    //  Consumes eight lengths at a time, the array must be padded to a multiple of eight.
+    uint64_t hash_lengths(const uint8_t* lengths, int count)
     {
-        return ptr[0] + (ptr[1] << 8) + (ptr[2] << 16) + (ptr[3] << 24);
+        uint64_t hash = uint64_t(count) * 0x9e3779b97f4a7c15ull;
+        for (int ix = 0; ix < count; ix += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, lengths + ix, sizeof word);
+            hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+            hash ^= hash >> 32;
+        }
+
+        return hash;
     }
 
 
-    uint32_t get_big_endian_uint32(const unsigned char* ptr)
+    //  Eight bytes in little endian order
+    inline uint64_t load_le_uint64(const uint8_t* ptr)
     {
-        return ptr[3] + (ptr[2] << 8) + (ptr[1] << 16) + (ptr[0] << 24);
+        uint64_t word;
+        std::memcpy(&word, ptr, sizeof word);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        return word;
     }
 
-} // namespace
-
 
-DeflateDecompressor::DeflateDecompressor()
-{
-    //  Sizes for the three decode tables
-    constexpr int code_lengths = 128;   // from zlib enough 19 7 7
-    constexpr int literal_lengths_max = 1334;  // from zlib enough 288 10 15
-    constexpr int distances_max = 402;  // from zlib enough 32 8 15
+    uint32_t get_little_endian_uint32(const unsigned char* ptr)
+    {
+        return ptr[0] + (ptr[1] << 8) + (ptr[2] << 16) + (ptr[3] << 24);
+    }
 
-    //  Place them all into a single vector
-    m_tables.resize(code_lengths + literal_lengths_max + distances_max);
-    m_code_length_decode_table = m_tables.data();
-    m_literal_length_decode_table = m_code_length_decode_table + code_lengths;
-    m_distance_decode_table = m_literal_length_decode_table + literal_lengths_max;
-}
 
+    //  Copy a match, the source possibly overlapping the destination
+    inline void copy_match(char* out, unsigned distance, unsigned length)
+    {
+        const char* source = out - distance;
 
-const char* DeflateDecompressor::get_build_info()
-{
-    return build_info;
-}
+        //  Special case of one repeating character. This happens really often.
+        if (distance == 1)
+        {
+            std::memset(out, *source, length);
+            return;
+        }
 
+        //  The complete source text is before the destination
+        if (length <= distance)
+        {
+            std::memcpy(out, source, length);
+            return;
+        }
 
-unsigned DeflateDecompressor::next_byte()
-{
-    if (m_input != m_input_end)
-    {
-        return *m_input++;
+        //  The normal "non-special" case, which is in fact rather rare.
+        //  Copy character by character, possibly overlapping the new data.
+        while (length--)
+        {
+            *out++ = *source++;
+        }
     }
 
-    return 0;
-}
-
 
-void DeflateDecompressor::make_available(int count)
-{
-    while (m_bits_available < count)
+    //  Output into an ordinary vector, growing it as needed.
+    class VectorOutput : public DeflateDecompressor::Output
     {
-        unsigned byte = next_byte();
-        m_bits |= (byte << m_bits_available);
-        m_bits_available += 8;
-    }
-}
+    public:
+        explicit VectorOutput(std::vector<char>& out) : m_out(out) {}
 
+        bool start(DeflateDecompressor::Window& window, size_t size_hint) override
+        {
+            //  Any old contents go, but the capacity gets reused. Only
+            //  as much as the hint asks for gets zeroed, not all of it.
+            m_out.clear();
+            m_out.resize(size_hint ? size_hint + match_room : 0);
+            set_window(window, 0);
+            return true;
+        }
 
-unsigned DeflateDecompressor::peek_bits(int count)
-{
-    //  Precomputed values for ((1 << count)-1)
-    //  The x86 has very slow shifts, so this simple
-    //  low level optimization is worthwhile.
-    //  Probably has the opposite effect on ARM.
-    static const int low_bits_mask[17] = {
-        0, 1, 3, 7, 15, 31, 63, 127,
-        255, 511, 1023, 2047, 4095,
-        8191, 16383, 32767, 65535,
-    };
+        bool make_room(DeflateDecompressor::Window& window, size_t needed) override
+        {
+            size_t used = window.next - window.begin;
+            size_t size = std::max(2*m_out.size(), used + needed);
+            m_out.resize(std::max(size, min_output_size));
+            set_window(window, used);
+            return true;
+        }
 
-    make_available(count);
-    return m_bits & low_bits_mask[count];
-}
+        bool finish(DeflateDecompressor::Window& window) override
+        {
+            m_out.resize(window.next - window.begin);
+            return true;
+        }
 
+    private:
+        void set_window(DeflateDecompressor::Window& window, size_t used)
+        {
+            window.begin = m_out.data();
+            window.next = window.begin + used;
+            window.end = window.begin + m_out.size();
+        }
 
-void DeflateDecompressor::drop_bits(int count)
-{
-    m_bits = (m_bits >> count);
-    m_bits_available -= count;
-}
+        std::vector<char>& m_out;
+    };
 
 
-unsigned DeflateDecompressor::get_bits(int count)
-{
-    unsigned bits = peek_bits(count);
-    m_bits = (m_bits >> count);
-    m_bits_available -= count;
-    return bits;
-}
+    //  Output that only keeps the last 32 KiB, for verifying the data.
+    //  The decompressor checksums everything before it's dropped.
+    class DiscardOutput : public DeflateDecompressor::Output
+    {
+    public:
+        explicit DiscardOutput(std::vector<char>& buffer) : m_buffer(buffer)
+        {
+            //  The history, and three times as much for new data
+            m_buffer.resize(4*window_size);
+        }
 
+        bool start(DeflateDecompressor::Window& window, size_t /*size_hint*/) override
+        {
+            window.begin = m_buffer.data();
+            window.next = window.begin;
+            window.end = window.begin + m_buffer.size();
+            return true;
+        }
 
-void DeflateDecompressor::align_input()
-{
-    int bytes_loaded = m_bits_available/8;
-    m_input -= bytes_loaded;
-    m_bits = 0;
-    m_bits_available = 0;
-}
+        bool make_room(DeflateDecompressor::Window& window, size_t needed) override
+        {
+            size_t kept = std::min<size_t>(window.next - window.begin, window_size);
+            if (m_buffer.size() - kept < needed)
+            {
+                return false;
+            }
 
+            std::memmove(m_buffer.data(), window.next - kept, kept);
+            window.next = window.begin + kept;
+            return true;
+        }
 
-unsigned DeflateDecompressor::read_le_uint16()
-{
-    unsigned result = next_byte();
-    result += next_byte() << 8;
-    return result;
-}
+        bool finish(DeflateDecompressor::Window& /*window*/) override
+        {
+            return true;
+        }
 
+        //  Stored data that's not needed as history is only checksummed
+        bool add_reference(DeflateDecompressor::Window& /*window*/, const char* /*data*/, size_t /*size*/) override
+        {
+            return true;
+        }
 
-unsigned DeflateDecompressor::in_bytes_available()
-{
-    return m_input_end - m_input;
-}
+    private:
+        std::vector<char>& m_buffer;
+    };
 
 
-bool DeflateDecompressor::build_decode_tables(const uint8_t* lengths, int literals_size, int distances_size)
-{
-    if (!build_decode_table(
-        m_distance_decode_table,
+    //  Output that drops everything before an offset, and collects the rest into
+    //  a vector. The part before the offset goes through a small sliding window.
+    class RangeOutput : public DeflateDecompressor::Output
+    {
+    public:
+        RangeOutput(std::vector<char>& buffer, uint64_t offset, std::vector<char>& out)
+            : m_buffer(buffer)
+            , m_offset(offset)
+            , m_out(out)
+        {
+        }
+
+        bool start(DeflateDecompressor::Window& window, size_t size_hint) override
+        {
+            m_skipped = 0;
+            m_history = 0;
+            m_out.clear();
+            m_skipping = (m_offset > 0);
+            if (m_skipping)
+            {
+                m_buffer.resize(4*window_size);
+                window.begin = m_buffer.data();
+                window.next = window.begin;
+                window.end = window.begin + m_buffer.size();
+                return true;
+            }
+
+            m_out.resize(size_hint ? size_hint + match_room : 0);
+            set_window(window, 0);
+            return true;
+        }
+
+        bool make_room(DeflateDecompressor::Window& window, size_t needed) override
+        {
+            size_t used = window.next - window.begin;
+            if (m_skipping && m_skipped + used < m_offset)
+            {
+                //  Keep the last 32 KiB as history, and drop the rest
+                size_t kept = std::min(used, window_size);
+                std::memmove(m_buffer.data(), window.next - kept, kept);
+                m_skipped += used - kept;
+                window.next = window.begin + kept;
+                return true;
+            }
+
+            if (m_skipping)
+            {
+                //  Past the offset. Move everything from the offset on to the
+                //  vector, preceded by the history that later matches may need.
+                size_t offset = size_t(m_offset - m_skipped);
+                size_t from = std::min(used - std::min(used, window_size), offset);
+                m_history = offset - from;
+                m_out.assign(window.begin + from, window.next);
+                m_skipping = false;
+                used -= from;
+            }
+
+            size_t size = std::max(2*m_out.size(), used + needed);
+            m_out.resize(std::max(size, min_output_size));
+            set_window(window, used);
+            return true;
+        }
+
+        bool finish(DeflateDecompressor::Window& window) override
+        {
+            if (m_skipping)
+            {
+                //  The data ended before the offset. Whatever's past it is still in the window.
+                size_t offset = size_t(m_offset - m_skipped);
+                size_t used = window.next - window.begin;
+                m_out.assign(window.begin + std::min(used, offset), window.next);
+                return true;
+            }
+
+            m_out.resize(window.next - window.begin);
+            m_out.erase(m_out.begin(), m_out.begin() + m_history);
+            return true;
+        }
+
+    private:
+        void set_window(DeflateDecompressor::Window& window, size_t used)
+        {
+            window.begin = m_out.data();
+            window.next = window.begin + used;
+            window.end = window.begin + m_out.size();
+        }
+
+        std::vector<char>& m_buffer;
+        uint64_t m_offset;
+        std::vector<char>& m_out;
+
+        bool m_skipping = false;
+
+        //  Bytes dropped from the beginning of the skip window
+        uint64_t m_skipped = 0;
+
+        //  Bytes before the offset at the beginning of the vector
+        size_t m_history = 0;
+    };
+
+
+    //  Input from an array of spans, one span per chunk
+    class SpanInput : public DeflateDecompressor::Input
+    {
+    public:
+        SpanInput(const DeflateDecompressor::Span* spans, size_t count) : m_next(spans), m_end(spans + count) {}
+
+        bool next_chunk(const char*& data, size_t& size) override
+        {
+            if (m_next == m_end)
+            {
+                return false;
+            }
+
+            data = m_next->data;
+            size = m_next->size;
+            ++m_next;
+            return true;
+        }
+
+    private:
+        const DeflateDecompressor::Span* m_next;
+        const DeflateDecompressor::Span* m_end;
+    };
+
+
+    //  The gzip size is modulo 2^32, so beyond 4 GiB it's too small, which only
+    //  makes the output grow later. A size more than deflate could expand the
+    //  input to is corrupt, and no use for reserving memory.
+    size_t gzip_size_hint(size_t input_size, uint32_t gzip_size)
+    {
+        constexpr uint64_t max_expansion = 1032;
+        if (gzip_size > uint64_t(input_size)*max_expansion)
+        {
+            return 0;
+        }
+
+        return gzip_size;
+    }
+
+
+    //  Copy bytes starting from an offset in a sequence of spans
+    void copy_from_spans(const DeflateDecompressor::Span* spans, size_t count, size_t offset, unsigned char* dest, size_t size)
+    {
+        for (size_t ix = 0; ix < count && size; ++ix)
+        {
+            if (offset >= spans[ix].size)
+            {
+                offset -= spans[ix].size;
+                continue;
+            }
+
+            size_t n = std::min(size, spans[ix].size - offset);
+            std::memcpy(dest, spans[ix].data + offset, n);
+            dest += n;
+            size -= n;
+            offset = 0;
+        }
+    }
+
+} // namespace
+
+
+//  Literal/length and distance tables built earlier, and the lengths they were built from
+struct DeflateDecompressor::TableCache
+{
+    struct Entry
+    {
+        bool valid = false;
+        uint64_t hash = 0;
+        int literals_size = 0;
+        int distances_size = 0;
+        BlockKind kind = BlockKind::General;
+        uint8_t lengths[lengths_array_size];
+        uint32_t literal_length_table[literal_length_table_size];
+        uint32_t distance_table[distance_table_size];
+    };
+
+    Entry entries[table_cache_size];
+    int next_victim = 0;
+};
+
+
+//  The tables of the static Huffman code never change. They're built
+//  once, and then shared by all decompressors in all threads.
+struct DeflateDecompressor::FixedHuffmanTables
+{
+    BlockKind kind = BlockKind::General;
+    uint32_t literal_length_table[literal_length_table_size];
+    uint32_t distance_table[distance_table_size];
+};
+
+
+//  A batch of tokens on its way to the consumer
+struct DeflateDecompressor::TokenPipeline
+{
+    struct Batch
+    {
+        uint32_t tokens[tokens_per_batch];
+        uint8_t literals[literals_per_batch];
+        int token_count = 0;
+        int literal_count = 0;
+    };
+
+    Batch batches[1];
+
+    TokenConsumer* consumer = nullptr;
+
+    //  Tokenizer state: the batch being filled, and its current literal run if any
+    Batch* batch = nullptr;
+    uint32_t* literal_run = nullptr;
+    uint64_t output_size = 0;
+
+    void reset()
+    {
+        output_size = 0;
+        start_batch();
+    }
+
+    void start_batch()
+    {
+        batch = &batches[0];
+        batch->token_count = 0;
+        batch->literal_count = 0;
+        literal_run = nullptr;
+    }
+
+    bool has_room(int token_count, int literal_count) const
+    {
+        return batch->token_count + token_count <= tokens_per_batch
+            && batch->literal_count + literal_count <= literals_per_batch;
+    }
+
+    void add_literal(uint8_t byte)
+    {
+        batch->literals[batch->literal_count] = byte;
+        add_literals(1);
+    }
+
+    //  Free space for literals, to be filled before add_literals
+    uint8_t* literal_space() const { return batch->literals + batch->literal_count; }
+    int literal_room() const { return literals_per_batch - batch->literal_count; }
+
+    void add_literals(int count)
+    {
+        if (!literal_run)
+        {
+            literal_run = &batch->tokens[batch->token_count++];
+            *literal_run = literal_run_flag;
+        }
+
+        *literal_run += count;
+        batch->literal_count += count;
+        output_size += count;
+    }
+
+    void add_match(unsigned length, unsigned distance)
+    {
+        batch->tokens[batch->token_count++] = (length << 16) | (distance - 1);
+        literal_run = nullptr;
+        output_size += length;
+    }
+
+    void add_block(int type, bool is_final_block, const uint8_t* lengths, int literal_codes, int distance_codes)
+    {
+        batch->tokens[batch->token_count++] = literal_run_flag | block_flag
+            | type | (is_final_block << 2) | (literal_codes << 8) | (distance_codes << 17);
+        //  Stored and static blocks have no lengths, and a null pointer
+        int count = literal_codes + distance_codes;
+        if (count)
+        {
+            std::memcpy(batch->literals + batch->literal_count, lengths, count);
+            batch->literal_count += count;
+        }
+        literal_run = nullptr;
+    }
+
+    TokenBatch view() const
+    {
+        TokenBatch view;
+        view.tokens = batch->tokens;
+        view.token_count = batch->token_count;
+        view.bytes = batch->literals;
+        view.byte_count = batch->literal_count;
+        return view;
+    }
+};
+
+
+DeflateDecompressor::DeflateDecompressor()
+{
+    m_code_length_decode_table = m_tables;
+    m_literal_length_decode_table = m_code_length_decode_table + code_length_table_size;
+    m_distance_decode_table = m_literal_length_decode_table + literal_length_table_size;
+}
+
+
+const DeflateDecompressor::FixedHuffmanTables& DeflateDecompressor::fixed_huffman_tables()
+{
+    //  Thread safe initialization, and read only after that
+    static const FixedHuffmanTables tables = []()
+    {
+        uint8_t lengths[lengths_array_size];
+
+        int ix = 0;
+        for (; ix < 144; ix++) lengths[ix] = 8;
+        for (; ix < 256; ix++) lengths[ix] = 9;
+        for (; ix < 280; ix++) lengths[ix] = 7;
+        for (; ix < 288; ix++) lengths[ix] = 8;
+
+        for (; ix < 288 + 32; ix++) lengths[ix] = 5;
+
+        FixedHuffmanTables fixed;
+        build_uncached_decode_tables(fixed.literal_length_table, fixed.distance_table, lengths, 288, 32, fixed.kind);
+        return fixed;
+    }();
+
+    return tables;
+}
+
+
+DeflateDecompressor::~DeflateDecompressor() = default;
+
+
+DeflateDecompressor& DeflateDecompressor::thread_instance()
+{
+    thread_local DeflateDecompressor instance;
+    return instance;
+}
+
+
+int deflate_decompress(const char* input, size_t size, std::vector<char>& out)
+{
+    return DeflateDecompressor::thread_instance().decompress(input, size, out);
+}
+
+
+int deflate_decompress(const char* input, size_t size, DeflateDecompressor::Output& out)
+{
+    return DeflateDecompressor::thread_instance().decompress(input, size, out);
+}
+
+
+const char* DeflateDecompressor::get_build_info()
+{
+    return build_info;
+}
+
+
+unsigned DeflateDecompressor::next_byte()
+{
+    if (m_input != m_input_end || refill_input())
+    {
+        return *m_input++;
+    }
+
+    //  Past the end of the input, pretend there are zeroes.
+    //  Keep count, so they can be told apart from real data.
+    ++m_input_overrun;
+    return 0;
+}
+
+
+//  Get the next chunk from a streaming input.
+//  Returns false at the end of the input.
+bool DeflateDecompressor::refill_input()
+{
+    if (!m_source)
+    {
+        return false;
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+    while (m_source->next_chunk(data, size))
+    {
+        if (size)
+        {
+            m_earlier_chunks_size += m_input_end - m_chunk_begin;
+            m_chunk_begin = reinterpret_cast<const uint8_t*>(data);
+            m_input = m_chunk_begin;
+            m_input_end = m_input + size;
+
+            //  The look-ahead over stored blocks is within a chunk
+            m_stored_run_end = nullptr;
+            m_stored_reference_end = nullptr;
+            return true;
+        }
+    }
+
+    //  Don't ask again after the input has ended
+    m_source = nullptr;
+    return false;
+}
+
+
+void DeflateDecompressor::make_available(int count)
+{
+    if (m_bits_available >= count)
+    {
+        return;
+    }
+
+    //  A refill may have left part of the next byte above the valid bits
+    m_bits &= ~(~uint64_t(0) << m_bits_available);
+    while (m_bits_available < count)
+    {
+        uint64_t byte = next_byte();
+        m_bits |= (byte << m_bits_available);
+        m_bits_available += 8;
+    }
+}
+
+
+//  Fill the bit buffer to at least 56 bits with a single load, taking as
+//  many whole bytes as fit. Near the end of a chunk, make just 'count' bits
+//  available a byte at a time instead, so that no more zeroes get made up
+//  past the end of the input than are needed.
+void DeflateDecompressor::refill_bits(int count)
+{
+    if (m_input_end - m_input < 8)
+    {
+        make_available(count);
+        return;
+    }
+
+    m_bits |= load_le_uint64(m_input) << m_bits_available;
+    m_input += (63 - m_bits_available) >> 3;
+    m_bits_available |= 56;
+}
+
+
+unsigned DeflateDecompressor::peek_bits(int count)
+{
+    //  Precomputed values for ((1 << count)-1)
+    //  The x86 has very slow shifts, so this simple
+    //  low level optimization is worthwhile.
+    //  Probably has the opposite effect on ARM.
+    static const int low_bits_mask[17] = {
+        0, 1, 3, 7, 15, 31, 63, 127,
+        255, 511, 1023, 2047, 4095,
+        8191, 16383, 32767, 65535,
+    };
+
+    make_available(count);
+    return m_bits & low_bits_mask[count];
+}
+
+
+void DeflateDecompressor::drop_bits(int count)
+{
+    m_bits = (m_bits >> count);
+    m_bits_available -= count;
+}
+
+
+unsigned DeflateDecompressor::get_bits(int count)
+{
+    unsigned bits = peek_bits(count);
+    m_bits = (m_bits >> count);
+    m_bits_available -= count;
+    return bits;
+}
+
+
+//  Skip to the next byte boundary. The whole bytes still in the bit buffer
+//  are given back to the input when they came from the current chunk.
+//  Otherwise they stay in the bit buffer, and next_aligned_byte takes them
+//  from there first.
+void DeflateDecompressor::align_input()
+{
+    drop_bits(m_bits_available % 8);
+
+    //  The zeroes made up past the end of the input were loaded last
+    int bytes_loaded = m_bits_available/8;
+    int made_up = std::min(bytes_loaded, m_input_overrun);
+    m_input_overrun -= made_up;
+    bytes_loaded -= made_up;
+
+    if (bytes_loaded <= m_input - m_chunk_begin)
+    {
+        m_input -= bytes_loaded;
+        m_bits = 0;
+        m_bits_available = 0;
+    }
+    else
+    {
+        m_bits_available = 8*bytes_loaded;
+    }
+}
+
+
+//  Put back bytes already taken with next_byte
+void DeflateDecompressor::unread_bytes(const uint8_t* bytes, int count)
+{
+    if (m_input_overrun == 0 && count <= m_input - m_chunk_begin)
+    {
+        m_input -= count;
+        return;
+    }
+
+    //  Made up zeroes stay counted, and align_input drops them again
+    m_bits &= ~(~uint64_t(0) << m_bits_available);
+    for (int i = 0; i < count; ++i)
+    {
+        m_bits |= uint64_t(bytes[i]) << m_bits_available;
+        m_bits_available += 8;
+    }
+}
+
+
+unsigned DeflateDecompressor::next_aligned_byte()
+{
+    if (m_bits_available)
+    {
+        return get_bits(8);
+    }
+
+    return next_byte();
+}
+
+
+unsigned DeflateDecompressor::read_le_uint16()
+{
+    unsigned result = next_aligned_byte();
+    result += next_aligned_byte() << 8;
+    return result;
+}
+
+
+uint32_t DeflateDecompressor::read_le_uint32()
+{
+    uint32_t result = read_le_uint16();
+    result += uint32_t(read_le_uint16()) << 16;
+    return result;
+}
+
+
+uint32_t DeflateDecompressor::read_be_uint32()
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        result = (result << 8) + next_aligned_byte();
+    }
+
+    return result;
+}
+
+
+//  Copy up to 'size' bytes after align_input. Returns the number of
+//  bytes copied, less than 'size' only if the input ends.
+size_t DeflateDecompressor::read_aligned_bytes(char* dest, size_t size)
+{
+    size_t count = 0;
+    while (count < size && m_bits_available)
+    {
+        dest[count++] = char(get_bits(8));
+    }
+
+    while (count < size && (m_input != m_input_end || refill_input()))
+    {
+        size_t chunk = std::min<size_t>(size - count, m_input_end - m_input);
+        std::memcpy(dest + count, m_input, chunk);
+        m_input += chunk;
+        count += chunk;
+    }
+
+    return count;
+}
+
+
+size_t DeflateDecompressor::in_bytes_available()
+{
+    return m_input_end - m_input;
+}
+
+
+bool DeflateDecompressor::build_decode_tables(const uint8_t* lengths, int literals_size, int distances_size)
+{
+    if (!m_table_cache_enabled)
+    {
+        uint32_t* literal_length_table = m_tables + code_length_table_size;
+        uint32_t* distance_table = literal_length_table + literal_length_table_size;
+        m_literal_length_decode_table = literal_length_table;
+        m_distance_decode_table = distance_table;
+        return build_uncached_decode_tables(
+            literal_length_table,
+            distance_table,
+            lengths,
+            literals_size,
+            distances_size,
+            m_block_kind);
+    }
+
+    if (!m_table_cache)
+    {
+        m_table_cache.reset(new TableCache);
+    }
+
+    //  The hash wants the lengths zero padded to a multiple of eight
+    int count = literals_size + distances_size;
+    uint8_t padded[lengths_array_size + 8];
+    std::memcpy(padded, lengths, count);
+    std::memset(padded + count, 0, 8);
+    uint64_t hash = hash_lengths(padded, count);
+
+    for (TableCache::Entry& entry : m_table_cache->entries)
+    {
+        if (entry.valid
+            && entry.hash == hash
+            && entry.literals_size == literals_size
+            && entry.distances_size == distances_size
+            && std::memcmp(entry.lengths, lengths, count) == 0)
+        {
+            ++m_table_cache_statistics.hits;
+            m_literal_length_decode_table = entry.literal_length_table;
+            m_distance_decode_table = entry.distance_table;
+            m_block_kind = entry.kind;
+            return true;
+        }
+    }
+
+    ++m_table_cache_statistics.misses;
+
+    TableCache::Entry& entry = m_table_cache->entries[m_table_cache->next_victim];
+    m_table_cache->next_victim = (m_table_cache->next_victim + 1) % table_cache_size;
+
+    entry.valid = build_uncached_decode_tables(
+        entry.literal_length_table,
+        entry.distance_table,
+        lengths,
+        literals_size,
+        distances_size,
+        entry.kind);
+
+    if (!entry.valid)
+    {
+        return false;
+    }
+
+    entry.hash = hash;
+    entry.literals_size = literals_size;
+    entry.distances_size = distances_size;
+    std::memcpy(entry.lengths, lengths, count);
+
+    m_literal_length_decode_table = entry.literal_length_table;
+    m_distance_decode_table = entry.distance_table;
+    m_block_kind = entry.kind;
+    return true;
+}
+
+
+bool DeflateDecompressor::build_uncached_decode_tables(
+    uint32_t* literal_length_table,
+    uint32_t* distance_table,
+    const uint8_t* lengths,
+    int literals_size,
+    int distances_size,
+    BlockKind& kind)
+{
+    //  The lengths of both alphabets are sorted in one pass over the array
+    SortedCodewords literal_lengths;
+    SortedCodewords distances;
+    sort_codewords(lengths, literals_size, distances_size, &literal_lengths, &distances);
+
+    if (!build_decode_table(
+        distance_table,
         distance_table_bits,
-        lengths + literals_size,
-        distance_values,
-        distances_size))
+        distances,
+        distance_values))
     {
         return false;
     }
 
     if (!build_decode_table(
-        m_literal_length_decode_table,
+        literal_length_table,
         literal_length_table_bits,
-        lengths,
-        literal_length_values,
-        literals_size))
+        literal_lengths,
+        literal_length_values))
     {
         return false;
     }
 
+    bool has_lengths = false;
+    for (int symbol = end_of_block + 1; symbol < literals_size; ++symbol)
+    {
+        has_lengths |= (lengths[symbol] != 0);
+    }
+
+    int distance_count = distances_size - distances.length_counts[0];
+    if (!has_lengths)
+    {
+        kind = BlockKind::LiteralsOnly;
+    }
+    else if (distance_count == 1 && distances.used_symbols()[0] == 0)
+    {
+        kind = BlockKind::RunLengths;
+    }
+    else if (literal_lengths.longest_length() <= literal_length_table_bits
+        && distances.longest_length() <= distance_table_bits)
+    {
+        kind = BlockKind::NoSubtables;
+    }
+    else
+    {
+        kind = BlockKind::General;
+    }
+
     return true;
 }
 
 
 int DeflateDecompressor::decompress(const char* input, size_t size, std::vector<char>& out)
 {
-    m_error_message = nullptr;
+    VectorOutput output(out);
+    return decompress(input, size, output);
+}
+
+
+int DeflateDecompressor::decompress(const char* input, size_t size, Output& out)
+{
+    m_source = nullptr;
+    m_chunk_begin = reinterpret_cast<const uint8_t*>(input);
+    m_input = m_chunk_begin;
+    m_input_end = m_input + size;
+
+    //  The gzip trailer contains original uncompressed data size.
+    //  Pass it on to the output as a hint. With trailing data
+    //  allowed, the end of the input may not be the trailer.
+    size_t gzip_size = 0;
+    if (size >= 18 && m_input[0] == 31 && m_input[1] == 139 && !m_trailing_data_allowed)
+    {
+        gzip_size = gzip_size_hint(size, get_little_endian_uint32(m_input_end-4));
+    }
+
+    return decompress_input(out, size, gzip_size);
+}
+
+
+int DeflateDecompressor::verify(const char* input, size_t size)
+{
+    DiscardOutput output(m_verify_buffer);
+    return decompress(input, size, output);
+}
+
+
+int DeflateDecompressor::verify(Input& input)
+{
+    DiscardOutput output(m_verify_buffer);
+    return decompress(input, output);
+}
+
+
+int DeflateDecompressor::decompress_prefix(const char* input, size_t size, size_t max_output, std::vector<char>& out)
+{
+    VectorOutput output(out);
+    return decompress_prefix(input, size, max_output, output);
+}
+
+
+int DeflateDecompressor::decompress_prefix(const char* input, size_t size, size_t max_output, Output& out)
+{
+    m_output_limit = max_output;
+    int err = decompress(input, size, out);
+    m_output_limit = no_output_limit;
+    return err;
+}
+
+
+int DeflateDecompressor::decompress_range(const char* input, size_t size, uint64_t offset, size_t max_output, std::vector<char>& out)
+{
+    //  The skip window is the same as for verify
+    RangeOutput output(m_verify_buffer, offset, out);
+    m_output_limit = (max_output < no_output_limit - offset) ? offset + max_output : no_output_limit;
+    m_checksum_enabled = false;
+    int err = decompress(input, size, output);
+    m_output_limit = no_output_limit;
+    m_checksum_enabled = true;
+    return err;
+}
+
+
+int DeflateDecompressor::decompress(Input& input, Output& out)
+{
+    m_source = &input;
+    m_source_persists = false;
+    m_chunk_begin = nullptr;
+    m_input = nullptr;
+    m_input_end = nullptr;
+
+    return decompress_input(out, 0, 0);
+}
+
+
+int DeflateDecompressor::decompress(const Span* spans, size_t count, std::vector<char>& out)
+{
+    VectorOutput output(out);
+    return decompress(spans, count, output);
+}
+
+
+int DeflateDecompressor::decompress(const Span* spans, size_t count, Output& out)
+{
+    size_t size = 0;
+    for (size_t ix = 0; ix < count; ++ix)
+    {
+        size += spans[ix].size;
+    }
+
+    //  The same gzip size hint as for a single piece of input
+    size_t gzip_size = 0;
+    if (size >= 18 && !m_trailing_data_allowed)
+    {
+        unsigned char magic[2];
+        unsigned char trailer[4];
+        copy_from_spans(spans, count, 0, magic, 2);
+        copy_from_spans(spans, count, size - 4, trailer, 4);
+        if (magic[0] == 31 && magic[1] == 139)
+        {
+            gzip_size = gzip_size_hint(size, get_little_endian_uint32(trailer));
+        }
+    }
 
-    m_input = reinterpret_cast<const uint8_t*>(input);
+    //  The spans stay valid, so stored data can still be referenced
+    SpanInput input(spans, count);
+    m_source = &input;
+    m_source_persists = true;
+    m_chunk_begin = nullptr;
+    m_input = nullptr;
+    m_input_end = nullptr;
+
+    int err = decompress_input(out, size, gzip_size);
+    m_source = nullptr;
+    return err;
+}
+
+
+int DeflateDecompressor::tokenize(const char* input, size_t size, TokenConsumer& consumer)
+{
+    m_source = nullptr;
+    m_chunk_begin = reinterpret_cast<const uint8_t*>(input);
+    m_input = m_chunk_begin;
     m_input_end = m_input + size;
+
+    return tokenize_input(consumer);
+}
+
+
+int DeflateDecompressor::tokenize(Input& input, TokenConsumer& consumer)
+{
+    m_source = &input;
+    m_source_persists = false;
+    m_chunk_begin = nullptr;
+    m_input = nullptr;
+    m_input_end = nullptr;
+
+    return tokenize_input(consumer);
+}
+
+
+int DeflateDecompressor::tokenize_input(TokenConsumer& consumer)
+{
+    m_error_message = nullptr;
+
     m_bits = 0;
     m_bits_available = 0;
-    m_out = &out;
+    m_input_overrun = 0;
+    m_earlier_chunks_size = 0;
+    m_input_consumed = 0;
+
+    Format format = skip_wrapper();
+    if (format == Format::Invalid)
+    {
+        return eInvalidInput;
+    }
 
-    //  Make sure the output is empty
-    m_out->clear();
+    m_format = format;
+    m_references_accepted = false;
 
-    //  Detect format and skip the wrapper if present
-    Format format = skip_gzip_wrapper();
-    if (format == Format::Raw)
+    if (!m_token_pipeline)
+    {
+        m_token_pipeline.reset(new TokenPipeline);
+    }
+
+    TokenPipeline& tokens = *m_token_pipeline;
+    tokens.reset();
+    tokens.consumer = &consumer;
+    m_tokens = &tokens;
+
+    int err = process_blocks();
+    bool consumed = err || consumer.consume(tokens.view());
+
+    tokens.consumer = nullptr;
+    m_tokens = nullptr;
+
+    if ((err == eOutputError && !m_error_message) || (!err && !consumed))
+    {
+        m_error_message = "ERR20: Token consumer stopped the decoding";
+        return eOutputError;
+    }
+
+    if (err)
+    {
+        return err;
+    }
+
+    m_output_size = tokens.output_size;
+    return check_trailer(false);
+}
+
+
+DeflateDecompressor::Token DeflateDecompressor::TokenBatch::Iterator::operator*() const
+{
+    Token token;
+    uint32_t word = *m_token;
+    if (!(word & literal_run_flag))
+    {
+        token.kind = Token::Match;
+        token.size = word >> 16;
+        token.distance = (word & 0xffff) + 1;
+    }
+    else if (!(word & block_flag))
+    {
+        token.kind = Token::Literals;
+        token.data = m_bytes;
+        token.size = word & ~literal_run_flag;
+    }
+    else
     {
-        format = skip_zlib_wrapper();
+        token.kind = Token::Block;
+        token.data = m_bytes;
+        token.size = block_lengths_count(word);
+        token.block_type = word & 3;
+        token.final_block = (word & 4) != 0;
+        token.literal_codes = (word >> 8) & 0x1ff;
+        token.distance_codes = (word >> 17) & 0x3f;
     }
 
+    return token;
+}
+
+
+DeflateDecompressor::TokenBatch::Iterator& DeflateDecompressor::TokenBatch::Iterator::operator++()
+{
+    uint32_t word = *m_token++;
+    if (word & literal_run_flag)
+    {
+        m_bytes += (word & block_flag) ? block_lengths_count(word) : (word & ~literal_run_flag);
+    }
+
+    return *this;
+}
+
+
+int DeflateDecompressor::decompress_input(Output& out, size_t input_size, size_t gzip_size)
+{
+    m_error_message = nullptr;
+
+    m_bits = 0;
+    m_bits_available = 0;
+    m_input_overrun = 0;
+    m_earlier_chunks_size = 0;
+    m_input_consumed = 0;
+    m_output = &out;
+    m_window = Window();
+
+    //  Detect format and skip the wrapper if present
+    Format format = skip_wrapper();
+
     //  A wrapper was detected, but had problems
     if (format == Format::Invalid)
     {
         return eInvalidInput;
     }
 
-    //  The gzip wrapper contains original uncompressed data size.
-    //  Use it to reserve the output vector.
-    if (format == Format::Gzip)
+    size_t size_hint = estimate_output_size(format, input_size, gzip_size);
+    bool limited = (m_output_limit != no_output_limit);
+    if (limited && (size_hint == 0 || size_hint > m_output_limit))
+    {
+        size_hint = size_t(m_output_limit);
+    }
+
+    m_output_truncated = false;
+    if (!m_output->start(m_window, size_hint))
+    {
+        return report_output_error();
+    }
+
+    m_format = format;
+    m_checksum = (format == Format::Zlib) ? 1 : 0;
+    m_checksum_next = m_window.next;
+    m_output_size = 0;
+
+    if (limited)
+    {
+        limit_window(0);
+    }
+
+    //  Referenced data must stay valid until the end,
+    //  and a streaming input drops its chunks as it goes.
+    //  Referenced data would go past an output limit.
+    m_references_accepted = (m_source == nullptr || m_source_persists) && !limited;
+    m_stored_run_end = nullptr;
+    m_stored_reference_end = nullptr;
+
+    int err = process_blocks();
+
+    //  Let the output finish even after an error, so it can keep the partial data
+    update_checksum();
+    if (limited)
+    {
+        m_window.end = m_output_end;
+    }
+
+    //  Stored data can go past the limit and end without asking for more room
+    if (limited && m_output_size > m_output_limit)
+    {
+        m_output_truncated = true;
+    }
+
+    if (m_output_truncated)
+    {
+        //  Whatever was decoded past the limit is still in the window
+        m_window.next -= size_t(m_output_size - m_output_limit);
+        m_output_size = m_output_limit;
+        m_error_message = nullptr;
+        err = eSuccess;
+    }
+
+    if (!m_output->finish(m_window) && !err)
+    {
+        err = report_output_error();
+    }
+
+    if (err || m_output_truncated)
+    {
+        return err;
+    }
+
+    err = check_trailer(m_checksum_enabled);
+
+    //  Keep a running average of the ratio for estimating output sizes
+    if (!err && m_input_consumed)
+    {
+        double ratio = double(m_output_size)/double(m_input_consumed);
+        m_observed_ratio = m_observed_ratio ? (3*m_observed_ratio + ratio)/4 : ratio;
+    }
+
+    return err;
+}
+
+
+size_t DeflateDecompressor::estimate_output_size(Format format, size_t input_size, size_t gzip_size) const
+{
+    const SizeHintPolicy& policy = m_size_hint_policy;
+    if (format == Format::Gzip && gzip_size)
+    {
+        return std::min(gzip_size, policy.max_trusted_gzip_size);
+    }
+
+    if (input_size == 0)
     {
-        m_out->reserve(get_little_endian_uint32(m_input_end+4));
+        return 0;
     }
 
+    double ratio = m_observed_ratio ? m_observed_ratio : policy.initial_ratio;
+    double estimate = std::max(double(input_size)*ratio, double(policy.min_estimate));
+    return size_t(std::min(estimate, double(policy.max_estimate)));
+}
+
+
+//  Process blocks up to and including the final one
+int DeflateDecompressor::process_blocks()
+{
     //  Valid block types
     constexpr int uncompressed = 0;
     constexpr int static_huffman = 1;
@@ -585,15 +1820,15 @@ int DeflateDecompressor::decompress(const char* input, size_t size, std::vector<
         switch (block_type)
         {
         case uncompressed:
-            err = process_uncompressed_block();
+            err = process_uncompressed_block(is_final_block);
             break;
 
         case static_huffman:
-            err = process_static_huffman_block();
+            err = process_static_huffman_block(is_final_block);
             break;
 
         case dynamic_huffman:
-            err = process_dynamic_huffman_block();
+            err = process_dynamic_huffman_block(is_final_block);
             break;
 
         default:
@@ -601,60 +1836,198 @@ int DeflateDecompressor::decompress(const char* input, size_t size, std::vector<
             break;
         }
 
-        if (err || is_final_block)
+        if (err || is_final_block)
+        {
+            break;
+        }
+    }
+
+    return err;
+}
+
+
+//  Verify the checksum and the size in the trailer, if there is one
+int DeflateDecompressor::check_trailer(bool verify_checksum)
+{
+    align_input();
+
+    uint32_t expected = 0;
+    uint32_t expected_size = uint32_t(m_output_size);
+    switch (m_format)
+    {
+    case Format::Zlib:
+        expected = read_be_uint32();
+        break;
+
+    case Format::Gzip:
+        expected = read_le_uint32();
+        expected_size = read_le_uint32();
+        break;
+
+    default:
+        break;
+    }
+
+    if (m_input_overrun)
+    {
+        return report_error("ERR17: Input ended in the middle of the data");
+    }
+
+    if (verify_checksum && expected != m_checksum)
+    {
+        report_error("ERR15: Data checksum mismatch");
+        return eChecksum;
+    }
+
+    //  The gzip size is modulo 2^32
+    if (expected_size != uint32_t(m_output_size))
+    {
+        report_error("ERR18: Data size doesn't match the size in the gzip trailer");
+        return eChecksum;
+    }
+
+    //  Whole bytes left in the bit buffer are unused
+    m_input_consumed = m_earlier_chunks_size + (m_input - m_chunk_begin) - m_bits_available/8;
+
+    //  Only the raw format has no definite end. Anything after a wrapped stream is an error,
+    //  unless the caller expects more.
+    if (m_format != Format::Raw && !m_trailing_data_allowed && (m_bits_available || m_input != m_input_end || refill_input()))
+    {
+        return report_error("ERR19: Unexpected data after the end of the stream");
+    }
+
+    return eSuccess;
+}
+
+
+int DeflateDecompressor::report_error(const char* message)
+{
+    m_error_message = message;
+    return eInvalidInput;
+}
+
+
+int DeflateDecompressor::report_invalid_codeword()
+{
+    return report_error("ERR01: Invalid codeword in input data");
+}
+
+
+int DeflateDecompressor::report_output_error()
+{
+    m_error_message = "ERR16: Output failed to provide space for the data";
+    return eOutputError;
+}
+
+
+bool DeflateDecompressor::make_room(size_t needed)
+{
+    //  The output may flush and drop the data, so checksum it first
+    update_checksum();
+
+    //  With an output limit, the output may still have room past the limited window
+    bool limited = (m_output_limit != no_output_limit);
+    if (limited)
+    {
+        //  Stopping at the limit looks like an output error until decompress_input sorts it out.
+        //  Right at the limit, the next symbol may still be the end, so it gets room.
+        if (m_output_size > m_output_limit)
         {
-            break;
+            m_output_truncated = true;
+            return false;
         }
+
+        m_window.end = m_output_end;
     }
 
-    if (err)
+    if ((!limited || size_t(m_window.end - m_window.next) < needed) && !m_output->make_room(m_window, needed))
     {
-        return err;
+        return false;
     }
 
-    //  Verify the checksum if it's available
-    uint32_t expected = 0;
-    uint32_t computed = 0;
-    switch (format)
+    if (limited)
+    {
+        limit_window(needed);
+    }
+
+    m_checksum_next = m_window.next;
+    return true;
+}
+
+
+//  Keep the window from reaching much past the output limit, so the
+//  decoder asks for more room soon after passing it. The room it needs
+//  comes on top, otherwise it would keep asking for the same room again.
+void DeflateDecompressor::limit_window(size_t needed)
+{
+    m_output_end = m_window.end;
+    size_t room = size_t(m_output_limit - m_output_size) + needed;
+    if (size_t(m_window.end - m_window.next) > room)
+    {
+        m_window.end = m_window.next + room;
+    }
+}
+
+
+void DeflateDecompressor::update_checksum()
+{
+    size_t size = m_window.next - m_checksum_next;
+    switch (m_checksum_enabled ? m_format : Format::Raw)
     {
     case Format::Zlib:
-        expected = get_big_endian_uint32(m_input_end);
-        computed = adler32(1, m_out->data(), m_out->size());
+        m_checksum = adler32(m_checksum, m_checksum_next, size);
         break;
 
     case Format::Gzip:
-        expected = get_little_endian_uint32(m_input_end);
-        computed = crc32(0, m_out->data(), m_out->size());
+        m_checksum = crc32(m_checksum, m_checksum_next, size);
         break;
 
     default:
         break;
     }
 
-    if (expected != computed)
-    {
-        report_error("ERR15: Data checksum mismatch");
-        return eChecksum;
-    }
-
-    return eSuccess;
+    m_output_size += size;
+    m_checksum_next = m_window.next;
 }
 
 
-int DeflateDecompressor::report_error(const char* message)
+DeflateDecompressor::Format DeflateDecompressor::skip_wrapper()
 {
-    m_error_message = message;
-    return eInvalidInput;
-}
+    //  The size of an in-memory input is known. Too small an input can't have
+    //  a wrapper: gzip needs at least a ten byte header, a four byte checksum,
+    //  and a four byte size word, and zlib a two byte header and a four byte
+    //  checksum, assuming no data at all.
+    bool size_known = (m_source == nullptr);
+    size_t size = in_bytes_available();
+
+    uint8_t header[3];
+    int count = 0;
+    header[count++] = uint8_t(next_byte());
+    header[count++] = uint8_t(next_byte());
 
+    //  id1, id2, and "compression method" have fixed values
+    if (header[0] == 31 && header[1] == 139 && (!size_known || size >= 18))
+    {
+        header[count++] = uint8_t(next_byte());
+        if (header[2] == 8)
+        {
+            return skip_gzip_header();
+        }
+    }
 
-int DeflateDecompressor::report_invalid_codeword()
-{
-    return report_error("ERR01: Invalid codeword in input data");
+    //  The method must be 8
+    if ((header[0] & 0x0f) == 8 && (!size_known || size >= 6))
+    {
+        return skip_zlib_header(header[0], header[1]);
+    }
+
+    unread_bytes(header, count);
+    return Format::Raw;
 }
 
 
-DeflateDecompressor::Format DeflateDecompressor::skip_gzip_wrapper()
+//  The first three bytes are already checked
+DeflateDecompressor::Format DeflateDecompressor::skip_gzip_header()
 {
     //  The rfc1952 defines these flags
     //constexpr int text_flag = 0x01;
@@ -666,43 +2039,46 @@ DeflateDecompressor::Format DeflateDecompressor::skip_gzip_wrapper()
     //  All known flags together
     constexpr int known_flags = 0x1f;
 
-    //  Must have at least a ten byte header, a four byte checksum,
-    //  and a four byte size word, assuming no data at all.
-    if (in_bytes_available() < 18)
-    {
-        return Format::Raw;
-    }
-
-    const unsigned char* header = m_input;
-
-    //  id1, id2, and "compression method" have fixed values
-    if (header[0] != 31 || header[1] != 139 || header[2] != 8)
+    //  The header may span several chunks of a streaming input,
+    //  so its checksum is computed a byte at a time.
+    static const char fixed_bytes[3] = { 31, char(139), 8 };
+    uint32_t header_crc = crc32(0, fixed_bytes, 3);
+    auto header_byte = [this, &header_crc]()
     {
-        return Format::Raw;
-    }
+        char byte = char(next_byte());
+        header_crc = crc32(header_crc, &byte, 1);
+        return uint8_t(byte);
+    };
 
     //  Unknown flags are an error, according to the rfc1952
-    int flags = header[3];
+    int flags = header_byte();
     if (flags & ~known_flags)
     {
         report_error("ERR10: Unknown flags in gzip header");
         return Format::Invalid;
     }
 
-    //  Skip the header and the trailer
-    m_input += 10;
-    m_input_end -= 8;
+    //  Skip modification time, extra flags, and operating system
+    for (int i = 0; i < 6; ++i)
+    {
+        header_byte();
+    }
 
     //  Skip the "extra field"
     if (flags & extra_info_flag)
     {
-        m_input += read_le_uint16();
+        unsigned size = header_byte();
+        size += header_byte() << 8;
+        while (size--)
+        {
+            header_byte();
+        }
     }
 
     //  Skip file name
     if (flags & name_flag)
     {
-        while (next_byte())
+        while (header_byte() && !m_input_overrun)
         {
         }
     }
@@ -710,7 +2086,7 @@ DeflateDecompressor::Format DeflateDecompressor::skip_gzip_wrapper()
     //  Skip comment
     if (flags & comment_flag)
     {
-        while (next_byte())
+        while (header_byte() && !m_input_overrun)
         {
         }
     }
@@ -718,9 +2094,8 @@ DeflateDecompressor::Format DeflateDecompressor::skip_gzip_wrapper()
     //  Verify the header checksum if it's present
     if (flags & header_crc_flag)
     {
-        uint32_t computed = crc32(0, reinterpret_cast<const char*>(header), m_input - header);
         uint32_t expected = read_le_uint16();
-        if (expected != (computed & 0xffff))
+        if (expected != (header_crc & 0xffff))
         {
             report_error("ERR11: Incorrect checksum in gzip header");
             return Format::Invalid;
@@ -731,32 +2106,14 @@ DeflateDecompressor::Format DeflateDecompressor::skip_gzip_wrapper()
 }
 
 
-DeflateDecompressor::Format DeflateDecompressor::skip_zlib_wrapper()
+//  The two header bytes are already read, and the method checked
+DeflateDecompressor::Format DeflateDecompressor::skip_zlib_header(int method_and_info, int flags)
 {
-    //  Must have at least a two byte header, and a four byte checksum,
-    //  meaning a minimum of 6 bytes even without any data
-    if (in_bytes_available() < 6)
-    {
-        return Format::Raw;
-    }
-
-    //  First byte has the "method and info"
-    int method_and_info = m_input[0];
-
-    //  The method must be 8
-    if ((method_and_info & 0x0f) != 8)
-    {
-        return Format::Raw;
-    }
-
     //  Already at this point it's quite certain that a zlib header is present.
     //  Decoding the data as raw DEFLATE input would interpret it as starting
     //  with an uncompressed block. A situation that any reasonable encoder would
     //  have encoded with a first byte of plain zero.
 
-    //  Second byte is the flags
-    int flags = m_input[1];
-
     //  The two bytes, taken as a 16 bit integer, must be a multiple of 31
     if ((256*method_and_info + flags) % 31)
     {
@@ -778,18 +2135,17 @@ DeflateDecompressor::Format DeflateDecompressor::skip_zlib_wrapper()
         return Format::Invalid;
     }
 
-    m_input += 2;       // skip the zlib header
-    m_input_end -= 4;   // skip the checksum
-
     return Format::Zlib;
 }
 
 
-int DeflateDecompressor::process_uncompressed_block()
+int DeflateDecompressor::process_uncompressed_block(bool is_final_block)
 {
     align_input();
 
-    if (in_bytes_available() < 4)
+    //  A streaming input has no known size, so running
+    //  out gets detected only when it happens
+    if (!m_source && in_bytes_available() < 4)
     {
         return report_error("ERR02: Not enough input for an uncompressed block");
     }
@@ -797,45 +2153,218 @@ int DeflateDecompressor::process_uncompressed_block()
     unsigned len = read_le_uint16();
     unsigned nlen = read_le_uint16();
 
+    if (m_input_overrun)
+    {
+        return report_error("ERR02: Not enough input for an uncompressed block");
+    }
+
     if ((~nlen & 0xffff) != len)
     {
         return report_error("ERR03: Uncompressed block length mismatch");
     }
 
-    if (len > in_bytes_available())
+    if (!m_source && len > in_bytes_available())
     {
         return report_error("ERR04: Uncompressed block size more than input bytes available");
     }
 
-    m_out->insert(m_out->end(), m_input, m_input+len);
-    m_input += len;
+    //  Pass on what the output is willing to take by reference
+    size_t reference_size = stored_bytes_to_reference(len, is_final_block);
+    if (reference_size)
+    {
+        //  The window has to be checksummed before the referenced data
+        update_checksum();
+        const char* data = reinterpret_cast<const char*>(m_input);
+        if (m_output->add_reference(m_window, data, reference_size))
+        {
+            switch (m_format)
+            {
+            case Format::Zlib:
+                m_checksum = adler32(m_checksum, data, reference_size);
+                break;
+
+            case Format::Gzip:
+                m_checksum = crc32(m_checksum, data, reference_size);
+                break;
+
+            default:
+                break;
+            }
+
+            m_checksum_next = m_window.next;
+            m_output_size += reference_size;
+            m_input += reference_size;
+            len -= reference_size;
+        }
+        else
+        {
+            m_references_accepted = false;
+        }
+    }
+
+    if (m_tokens)
+    {
+        if (!add_block_token(0, is_final_block, nullptr, 0, 0))
+        {
+            return eOutputError;
+        }
+
+        return tokenize_stored_data(len);
+    }
+
+    while (len)
+    {
+        if (m_window.next == m_window.end && !make_room(std::min<size_t>(len, window_size)))
+        {
+            return report_output_error();
+        }
+
+        size_t wanted = std::min<size_t>(len, m_window.end - m_window.next);
+        size_t count = read_aligned_bytes(m_window.next, wanted);
+        m_window.next += count;
+        len -= count;
+
+        if (count < wanted)
+        {
+            return report_error("ERR04: Uncompressed block size more than input bytes available");
+        }
+    }
 
     return eSuccess;
 }
 
 
-int DeflateDecompressor::process_static_huffman_block()
+bool DeflateDecompressor::add_block_token(
+    int type, bool is_final_block, const uint8_t* lengths, int literal_codes, int distance_codes)
 {
-    uint8_t lengths[lengths_array_size];
+    if (!m_tokens->has_room(1, literal_codes + distance_codes) && !next_token_batch())
+    {
+        return false;
+    }
 
-    int ix = 0;
-    for (; ix < 144; ix++) lengths[ix] = 8;
-    for (; ix < 256; ix++) lengths[ix] = 9;
-    for (; ix < 280; ix++) lengths[ix] = 7;
-    for (; ix < 288; ix++) lengths[ix] = 8;
+    m_tokens->add_block(type, is_final_block, lengths, literal_codes, distance_codes);
+    return true;
+}
 
-    for (; ix < 288 + 32; ix++) lengths[ix] = 5;
 
-    if (!build_decode_tables(lengths, 288, 32))
+//  Pass stored data on as literal runs
+int DeflateDecompressor::tokenize_stored_data(size_t len)
+{
+    TokenPipeline& tokens = *m_tokens;
+    while (len)
     {
-        return eInvalidInput;
+        if (!tokens.has_room(1, 1) && !next_token_batch())
+        {
+            return eOutputError;
+        }
+
+        size_t wanted = std::min<size_t>(len, tokens.literal_room());
+        size_t count = read_aligned_bytes(reinterpret_cast<char*>(tokens.literal_space()), wanted);
+        tokens.add_literals(int(count));
+        len -= count;
+
+        if (count < wanted)
+        {
+            return report_error("ERR04: Uncompressed block size more than input bytes available");
+        }
+    }
+
+    return eSuccess;
+}
+
+
+//  Number of bytes at the beginning of a stored block that can't be
+//  needed for back-references, and can be passed on by reference.
+size_t DeflateDecompressor::stored_bytes_to_reference(size_t len, bool is_final_block)
+{
+    //  A block that continues in the next chunk of input gets copied
+    if (!m_references_accepted || len > in_bytes_available())
+    {
+        return 0;
+    }
+
+    //  Find where this run of consecutive stored blocks ends, unless already known.
+    //  The block headers are byte aligned, so it's easy to look ahead.
+    if (m_input >= m_stored_run_end)
+    {
+        //  Three header bits, padding to a byte boundary, and the lengths
+        constexpr int header_size = 5;
+
+        const uint8_t* block_end = m_input + len;
+        size_t data_size = len;
+        bool ends_stream = is_final_block;
+        while (!ends_stream && m_input_end - block_end >= header_size)
+        {
+            unsigned header = block_end[0];
+            unsigned next_len = block_end[1] + (block_end[2] << 8);
+            unsigned next_nlen = block_end[3] + (block_end[4] << 8);
+            if ((header & 6) != 0 || (~next_nlen & 0xffff) != next_len)
+            {
+                break;
+            }
+
+            if (size_t(m_input_end - block_end) < header_size + next_len)
+            {
+                break;
+            }
+
+            block_end += header_size + next_len;
+            data_size += next_len;
+            ends_stream = header & 1;
+        }
+
+        m_stored_run_end = block_end;
+        m_stored_reference_end = block_end;
+
+        //  Unless nothing follows, the last 32 KiB of the data must go to the window.
+        //  Walk the blocks again to find where that begins.
+        if (!ends_stream)
+        {
+            m_stored_reference_end = m_input;
+            if (data_size > window_size)
+            {
+                size_t skip = data_size - window_size;
+                const uint8_t* data = m_input;
+                size_t block_size = len;
+                while (skip > block_size)
+                {
+                    skip -= block_size;
+                    data += block_size;
+                    block_size = data[1] + (data[2] << 8);
+                    data += header_size;
+                }
+
+                m_stored_reference_end = data + skip;
+            }
+        }
+    }
+
+    if (m_input >= m_stored_reference_end)
+    {
+        return 0;
+    }
+
+    return std::min<size_t>(len, m_stored_reference_end - m_input);
+}
+
+
+int DeflateDecompressor::process_static_huffman_block(bool is_final_block)
+{
+    const FixedHuffmanTables& fixed = fixed_huffman_tables();
+    m_literal_length_decode_table = fixed.literal_length_table;
+    m_distance_decode_table = fixed.distance_table;
+    m_block_kind = fixed.kind;
+
+    if (m_tokens && !add_block_token(1, is_final_block, nullptr, 0, 0))
+    {
+        return eOutputError;
     }
 
     return decompress_the_block();
 }
 
 
-int DeflateDecompressor::process_dynamic_huffman_block()
+int DeflateDecompressor::process_dynamic_huffman_block(bool is_final_block)
 {
     constexpr int max_code_length_codewords = 19;
     static const uint8_t code_length_code_order[max_code_length_codewords] = {
@@ -859,12 +2388,13 @@ int DeflateDecompressor::process_dynamic_huffman_block()
     }
 
     //  Build the decode table for the code length alphabet
+    SortedCodewords code_lengths;
+    sort_codewords(lengths, max_code_length_codewords, 0, &code_lengths, nullptr);
     if (!build_decode_table(
         m_code_length_decode_table,
         code_length_table_bits,
-        lengths,
-        code_length_values,
-        max_code_length_codewords))
+        code_lengths,
+        code_length_values))
     {
         return eInvalidInput;
     }
@@ -885,7 +2415,7 @@ int DeflateDecompressor::process_dynamic_huffman_block()
             return report_invalid_codeword();
         }
 
-        drop_bits(entry & extra_mask);
+        drop_bits(entry & total_bits_mask);
         unsigned symbol = entry >> data_shift;
 
         //  single explicit length value
@@ -940,130 +2470,265 @@ int DeflateDecompressor::process_dynamic_huffman_block()
         return eInvalidInput;
     }
 
+    if (m_tokens && !add_block_token(2, is_final_block, lengths, literal_length_codes, distance_codes))
+    {
+        return eOutputError;
+    }
+
     return decompress_the_block();
 }
 
 
 int DeflateDecompressor::decompress_the_block()
 {
+    if (m_tokens)
+    {
+        return decode_symbols<true, BlockKind::General>();
+    }
+
+    //  A loop of its own for each kind of block, without the branches
+    //  that can't be taken in it
+    switch (m_block_kind)
+    {
+    case BlockKind::NoSubtables:
+        return decode_symbols<false, BlockKind::NoSubtables>();
+
+    case BlockKind::LiteralsOnly:
+        return decode_symbols<false, BlockKind::LiteralsOnly>();
+
+    case BlockKind::RunLengths:
+        return decode_symbols<false, BlockKind::RunLengths>();
+
+    default:
+        return decode_symbols<false, BlockKind::General>();
+    }
+}
+
+
+//  Decode literals and matches until the end of the block. They are either
+//  written to the window, or passed on as tokens when tokenizing.
+template <bool tokenize, DeflateDecompressor::BlockKind kind>
+int DeflateDecompressor::decode_symbols()
+{
+    constexpr bool subtables = (kind != BlockKind::NoSubtables);
+    constexpr bool literals_only = (kind == BlockKind::LiteralsOnly);
+    constexpr bool run_lengths = (kind == BlockKind::RunLengths);
+
+    //  The bit buffer and the write position are kept in locals. Stores into
+    //  the window could alias the members, which would send them through
+    //  memory on every symbol. The members are brought up to date around
+    //  anything else that uses them. The window belongs to the other thread
+    //  while tokenizing.
+    uint64_t bit_buffer = m_bits;
+    int bits_available = m_bits_available;
+    const uint8_t* in = m_input;
+    char* out = tokenize ? nullptr : m_window.next;
+
+    auto save_state = [&]()
+    {
+        m_bits = bit_buffer;
+        m_bits_available = bits_available;
+        m_input = in;
+        if (!tokenize)
+        {
+            m_window.next = out;
+        }
+    };
+
+    auto load_state = [&]()
+    {
+        bit_buffer = m_bits;
+        bits_available = m_bits_available;
+        in = m_input;
+        if (!tokenize)
+        {
+            out = m_window.next;
+        }
+    };
+
+    //  Same as refill_bits
+    auto refill = [&](int count)
+    {
+        if (m_input_end - in < 8)
+        {
+            save_state();
+            make_available(count);
+            load_state();
+            return;
+        }
+
+        bit_buffer |= load_le_uint64(in) << bits_available;
+        in += (63 - bits_available) >> 3;
+        bits_available |= 56;
+    };
+
+    auto finish = [&](int result)
+    {
+        save_state();
+        return result;
+    };
+
+    TokenPipeline* tokens = m_tokens;
     for (;;)
     {
-        //  Decode the length
-        unsigned index = peek_bits(literal_length_table_bits);
-        uint32_t entry = m_literal_length_decode_table[index];
-        if (entry == invalid_codeword)
+        if (tokenize)
         {
-            return report_invalid_codeword();
+            //  Make sure the batch has room for one more of anything
+            if (!tokens->has_room(2, 1))
+            {
+                if (m_input_overrun > 4)
+                {
+                    return finish(report_error("ERR17: Input ended in the middle of the data"));
+                }
+
+                if (!next_token_batch())
+                {
+                    return finish(eOutputError);
+                }
+            }
+        }
+        //  Make sure there's room for the longest possible match
+        else if (m_window.end - out < max_match_length)
+        {
+            //  Made up zeroes can decode to data forever. Stop here at the
+            //  latest, well after a real end would have been detected.
+            if (m_input_overrun > 4)
+            {
+                return finish(report_error("ERR17: Input ended in the middle of the data"));
+            }
+
+            save_state();
+            if (!make_room(max_match_length))
+            {
+                return report_output_error();
+            }
+
+            load_state();
+        }
+
+        //  Decode the length. After a refill the bits for the whole match
+        //  are in the bit buffer, and the distance needs no refill of its own.
+        if (bits_available < max_length_code_bits)
+        {
+            refill(max_length_code_bits);
         }
 
-        int bit_count = entry & extra_mask;
+        uint64_t bits = bit_buffer;
+        uint32_t entry = m_literal_length_decode_table[bits & literal_length_table_mask];
         if (entry & subtable_flag)
         {
-            drop_bits(literal_length_table_bits);
-            index = (entry >> data_shift) + peek_bits(bit_count);
-            entry = m_literal_length_decode_table[index];
-            if (entry == invalid_codeword)
+            //  Without subtables, that can only be an invalid codeword
+            if (!subtables || entry == invalid_codeword)
             {
-                return report_invalid_codeword();
+                return finish(report_invalid_codeword());
             }
 
-            bit_count = entry & extra_mask;
+            bits >>= literal_length_table_bits;
+            bit_buffer = bits;
+            bits_available -= literal_length_table_bits;
+            entry = m_literal_length_decode_table[(entry >> data_shift) + (bits & ~(~0u << (entry & total_bits_mask)))];
+            if (entry == invalid_codeword)
+            {
+                return finish(report_invalid_codeword());
+            }
         }
-        drop_bits(bit_count);
+
+        bit_buffer >>= (entry & total_bits_mask);
+        bits_available -= (entry & total_bits_mask);
         if (entry & literal_flag)
         {
-            m_out->push_back(entry >> data_shift);
+            if (tokenize)
+            {
+                tokens->add_literal(uint8_t(entry >> data_shift));
+            }
+            else
+            {
+                *out++ = char(entry >> data_shift);
+            }
             continue;
         }
 
-        entry >>= data_shift;
-
-        //  End of block
-        if (entry == 0)
+        //  End of block, the only other symbol there can be without length codes
+        if (literals_only || (entry >> data_shift) == 0)
         {
-            return eSuccess;
+            return finish(eSuccess);
         }
 
-        unsigned length = entry >> data_shift;
-        int extra = entry & extra_mask;
-        if (extra)
-        {
-            length += get_bits(extra);
-        }
+        unsigned length = entry_value(entry, bits);
 
         //  distance
 
-        index = peek_bits(distance_table_bits);
-        entry = m_distance_decode_table[index];
-        if (entry == invalid_codeword)
+        if (bits_available < max_distance_code_bits)
         {
-            return report_invalid_codeword();
+            refill(max_distance_code_bits);
         }
 
-        bit_count = entry & extra_mask;
+        bits = bit_buffer;
+        entry = m_distance_decode_table[bits & distance_table_mask];
         if (entry & subtable_flag)
         {
-            drop_bits(distance_table_bits);
-            index = (entry >> data_shift) + peek_bits(bit_count);
-            entry = m_distance_decode_table[index];
-            if (entry == invalid_codeword)
+            if (!subtables || entry == invalid_codeword)
             {
-                return report_invalid_codeword();
+                return finish(report_invalid_codeword());
             }
 
-            bit_count = entry & extra_mask;
+            bits >>= distance_table_bits;
+            bit_buffer = bits;
+            bits_available -= distance_table_bits;
+            entry = m_distance_decode_table[(entry >> data_shift) + (bits & ~(~0u << (entry & total_bits_mask)))];
+            if (entry == invalid_codeword)
+            {
+                return finish(report_invalid_codeword());
+            }
         }
-        drop_bits(bit_count);
 
-        entry >>= data_shift;
+        bit_buffer >>= (entry & total_bits_mask);
+        bits_available -= (entry & total_bits_mask);
+        unsigned distance = entry_value(entry, bits);
 
-        unsigned distance = entry >> data_shift;
-        extra = entry & extra_mask;
-        if (extra)
+        if (tokenize)
         {
-            distance += get_bits(extra);
-        }
-
-        //  Current size of the output
-        unsigned size = m_out->size();
+            //  The output doesn't exist yet, only its size
+            if (distance > tokens->output_size)
+            {
+                return finish(report_error("ERR09: Encoded distance not within buffer limits"));
+            }
 
-        //  Distance must be within the existing buffer
-        if (distance > size)
-        {
-            return report_error("ERR09: Encoded distance not within buffer limits");
+            tokens->add_match(length, distance);
+            continue;
         }
 
-        //  Special case of one repeating character: Let resize do the copying.
-        //  This happens really often.
-        if (distance == 1)
+        //  Distance must be within the data available
+        if (distance > size_t(out - m_window.begin))
         {
-            const char ch = m_out->back();
-            m_out->resize(size + length, ch);
-            continue;
+            return finish(report_error("ERR09: Encoded distance not within buffer limits"));
         }
 
-        //  Make sure that pointers stay valid during copying
-        m_out->reserve(size + length);
-
-        //  Data to be copied
-        const char* source = m_out->data() + size - distance;
-
-        //  Use "insert" if the the complete source text is within the current buffer.
-        if (length <= distance)
+        if (run_lengths)
         {
-            m_out->insert(m_out->end(), source, source + length);
-            continue;
+            std::memset(out, out[-1], length);
         }
-
-        //  The normal "non-special" case, which is in fact rather rare.
-        //  Copy character by character, possibly overlapping the new data.
-        while (length--)
+        else
         {
-            m_out->push_back(*source++);
+            copy_match(out, distance, length);
         }
+
+        out += length;
+    }
+}
+
+
+//  Give the current batch to the consumer, and start a new one
+bool DeflateDecompressor::next_token_batch()
+{
+    TokenPipeline& tokens = *m_tokens;
+    if (!tokens.consumer->consume(tokens.view()))
+    {
+        return false;
     }
 
-    return eSuccess;
+    tokens.start_batch();
+    return true;
 }
 
 
@@ -1079,7 +2744,7 @@ uint32_t DeflateDecompressor::adler32(uint32_t adler, const char* input, size_t
     const uint8_t* const input_end = ptr + size;
     while (ptr != input_end)
     {
-        unsigned batch_size = input_end - ptr;
+        size_t batch_size = input_end - ptr;
         if (batch_size > max_batch)
         {
             batch_size = max_batch;
@@ -4,13 +4,20 @@
 */
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 class DeflateDecompressor
 {
 public:
     DeflateDecompressor();
+    ~DeflateDecompressor();
+
+    //  The decode tables refer to storage inside the object
+    DeflateDecompressor(const DeflateDecompressor&) = delete;
+    DeflateDecompressor& operator=(const DeflateDecompressor&) = delete;
 
     //  Possible return values for decompress.
     //  Zero means success, anything else is an error of some sort.
@@ -24,9 +31,192 @@ public:
 
         //  Some problem with the input
         eInvalidInput,
+
+        //  The output object failed to provide space for the data
+        eOutputError,
+    };
+
+    //  The decompressor writes directly into memory provided by an Output object.
+    //  The window describes that memory: [begin, next) holds the output so far,
+    //  or at least its last 32 KiB for back-references, and [next, end) is free.
+    struct Window
+    {
+        char* begin = nullptr;
+        char* next = nullptr;
+        char* end = nullptr;
+    };
+
+    //  Destination of the decompressed data.
+    class Output
+    {
+    public:
+        virtual ~Output() = default;
+
+        //  Set up the initial window. The size_hint is the expected
+        //  output size, or zero if it isn't known.
+        virtual bool start(Window& window, size_t size_hint) = 0;
+
+        //  The decoder wants room for a whole match before every symbol.
+        //  A window of size_hint + match_room bytes is enough to never
+        //  need make_room when the hint is exact.
+        static constexpr size_t match_room = 258;
+
+        //  Make room for at least 'needed' bytes, never more than 32 KiB,
+        //  after window.next. The last 32 KiB before window.next must stay
+        //  available, but older data may be flushed and dropped.
+        virtual bool make_room(Window& window, size_t needed) = 0;
+
+        //  All data has been written. [window.begin, window.next) ends the output.
+        virtual bool finish(Window& window) = 0;
+
+        //  Optionally take a piece of stored (uncompressed) data by reference
+        //  instead of having it copied into the window. The data points into
+        //  the input, so it stays valid until decompress returns. It follows
+        //  everything in the window, and is never needed for back-references.
+        //  Return false to have it copied as usual.
+        virtual bool add_reference(Window& /*window*/, const char* /*data*/, size_t /*size*/)
+        {
+            return false;
+        }
+    };
+
+    //  Source of input for streaming decompression, a chunk at a time.
+    class Input
+    {
+    public:
+        virtual ~Input() = default;
+
+        //  Provide the next chunk of input. It must stay valid until the next
+        //  call, but not longer. Return false at the end of the input.
+        virtual bool next_chunk(const char*& data, size_t& size) = 0;
     };
 
     int decompress(const char* input, size_t size, std::vector<char>& out);
+    int decompress(const char* input, size_t size, Output& out);
+
+    //  Check the integrity of the data without keeping the output. It's decoded
+    //  into a small window that gets reused, and the checksum and the gzip size
+    //  are checked as usual. Returns the same codes as decompress.
+    int verify(const char* input, size_t size);
+    int verify(Input& input);
+
+    //  Decompress only the first max_output bytes, for sniffing the content.
+    //  Decoding stops as soon as there's that much output, leaving the rest of
+    //  the input and the checksum unchecked, and output_truncated returns true.
+    //  If the data ends sooner, all of it is checked as usual.
+    int decompress_prefix(const char* input, size_t size, size_t max_output, std::vector<char>& out);
+    int decompress_prefix(const char* input, size_t size, size_t max_output, Output& out);
+
+    //  Did the last decompress_prefix stop before the end of the data
+    bool output_truncated() const { return m_output_truncated; }
+
+    //  Decompress at most max_output bytes starting from an output offset.
+    //  Everything before the offset is decoded into a small window that gets
+    //  reused, so it stays in the cache and never reaches the output. The
+    //  checksum isn't computed, but the gzip size is checked if the data
+    //  gets decoded to the end. output_truncated works as for decompress_prefix.
+    int decompress_range(const char* input, size_t size, uint64_t offset, size_t max_output, std::vector<char>& out);
+
+    //  Streaming decompression. Nothing from the input is kept beyond the
+    //  current chunk, so the output only needs to keep its last 32 KiB.
+    int decompress(Input& input, Output& out);
+
+    //  A piece of input that's split into several, such as
+    //  the zlib stream in the IDAT chunks of a PNG image.
+    struct Span
+    {
+        const char* data;
+        size_t size;
+    };
+
+    //  Decompress input that's in pieces, without gathering it together.
+    //  The bits are read across the piece boundaries. All the pieces must
+    //  stay valid until decompress returns.
+    int decompress(const Span* spans, size_t count, std::vector<char>& out);
+    int decompress(const Span* spans, size_t count, Output& out);
+
+    //  Decoding into LZ77 tokens, without producing the output.
+    //
+    //  Each token is a 32-bit word in one of three forms:
+    //
+    //    (length << 16) | (distance - 1)
+    //        A match: copy 'length' bytes (3 to 258) from 'distance' bytes
+    //        back (1 to 32768).
+    //
+    //    0x80000000 | count
+    //        A run of 'count' literal bytes.
+    //
+    //    0xc0000000 | type | (final << 2) | (literal_codes << 8) | (distance_codes << 17)
+    //        The start of a block. The type is 0 for stored, 1 for static
+    //        Huffman, and 2 for dynamic Huffman. A dynamic block has the
+    //        codeword lengths of its literal/length and distance codes, in
+    //        that order. The other blocks have zero for both counts.
+    //
+    //  The literal bytes and the codeword lengths are in a separate byte
+    //  array, in the same order as the tokens that refer to them. Stored
+    //  data comes as literal runs after the block token.
+    //
+    struct Token
+    {
+        enum Kind { Literals, Match, Block };
+        Kind kind = Literals;
+
+        //  Literals: the bytes. Block: the codeword lengths.
+        const uint8_t* data = nullptr;
+
+        //  Literals: number of bytes. Match: length. Block: number of codeword lengths.
+        uint32_t size = 0;
+
+        //  Match only
+        uint32_t distance = 0;
+
+        //  Block only
+        int block_type = 0;
+        bool final_block = false;
+        int literal_codes = 0;
+        int distance_codes = 0;
+    };
+
+    struct TokenBatch
+    {
+        const uint32_t* tokens = nullptr;
+        size_t token_count = 0;
+        const uint8_t* bytes = nullptr;
+        size_t byte_count = 0;
+
+        //  Walks the tokens, and the bytes along with them
+        class Iterator
+        {
+        public:
+            Iterator(const uint32_t* token, const uint8_t* bytes) : m_token(token), m_bytes(bytes) {}
+
+            Token operator*() const;
+            Iterator& operator++();
+            bool operator==(const Iterator& other) const { return m_token == other.m_token; }
+            bool operator!=(const Iterator& other) const { return m_token != other.m_token; }
+
+        private:
+            const uint32_t* m_token;
+            const uint8_t* m_bytes;
+        };
+
+        Iterator begin() const { return Iterator(tokens, bytes); }
+        Iterator end() const { return Iterator(tokens + token_count, bytes + byte_count); }
+    };
+
+    //  Receives the tokens a batch at a time. The batch is valid only during
+    //  the call. Return false to stop decoding.
+    class TokenConsumer
+    {
+    public:
+        virtual ~TokenConsumer() = default;
+        virtual bool consume(const TokenBatch& batch) = 0;
+    };
+
+    //  The structure of the data, and the sizes in a gzip trailer, are checked
+    //  as usual. The checksum isn't, because it would need the output.
+    int tokenize(const char* input, size_t size, TokenConsumer& consumer);
+    int tokenize(Input& input, TokenConsumer& consumer);
 
     //  Returns a brief description of the last error detected.
     //  Returns nullptr in case of no errors.
@@ -41,46 +231,203 @@ public:
     //  Human readable info about the build and the binary
     static const char* get_build_info();
 
+    //  A decompressor kept around for the calling thread.
+    //  A DeflateDecoder (deflate_decoder.h) can be shared by threads instead.
+    static DeflateDecompressor& thread_instance();
+
+    //  Optionally, recently built decode tables are cached, keyed by the
+    //  codeword lengths that define them. Blocks using the same codes as an
+    //  earlier block then skip building the tables. Off by default: the cache
+    //  takes about 29 KiB, allocated on first use, and most streams don't
+    //  repeat their codes.
+    struct TableCacheStatistics
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    void set_table_cache_enabled(bool enabled) { m_table_cache_enabled = enabled; }
+    const TableCacheStatistics& table_cache_statistics() const { return m_table_cache_statistics; }
+    void reset_table_cache_statistics() { m_table_cache_statistics = TableCacheStatistics(); }
+
+    //  Normally anything after the end of a zlib or gzip stream is an error.
+    //  With trailing data allowed, decoding stops right after the trailer,
+    //  and input_consumed tells where the next stream would start.
+    void set_trailing_data_allowed(bool allowed) { m_trailing_data_allowed = allowed; }
+
+    //  How much output space to ask for up front. The size in a gzip trailer is
+    //  used up to a limit, since it's easy to fake. Otherwise the estimate is
+    //  the input size times the average ratio seen in earlier decompresses,
+    //  within bounds. A streaming input has no known size, and no estimate.
+    struct SizeHintPolicy
+    {
+        size_t max_trusted_gzip_size = 256*1024*1024;
+        size_t min_estimate = 16*1024;
+        size_t max_estimate = 64*1024*1024;
+        double initial_ratio = 3.0;
+    };
+
+    void set_size_hint_policy(const SizeHintPolicy& policy) { m_size_hint_policy = policy; m_observed_ratio = 0; }
+    const SizeHintPolicy& size_hint_policy() const { return m_size_hint_policy; }
+
+    //  Input bytes up to the end of the stream, including the trailer.
+    //  For a raw stream, including the byte the final block ends in.
+    //  Valid after a successful decompress or tokenize.
+    uint64_t input_consumed() const { return m_input_consumed; }
+
 private:
 
     int report_error(const char* message);
     int report_invalid_codeword();
+    int report_output_error();
 
     //  Possible input formats
     enum class Format { Invalid, Raw, Zlib, Gzip };
 
-    Format skip_gzip_wrapper();
-    Format skip_zlib_wrapper();
+    //  What the decode loop of a block has to be prepared for, from its codeword lengths.
+    //  NoSubtables: every codeword fits the main tables, one lookup per symbol.
+    //  LiteralsOnly: no length codes, so no matches.
+    //  RunLengths: distance 1 is the only distance code, every match repeats a byte.
+    enum class BlockKind { General, NoSubtables, LiteralsOnly, RunLengths };
+
+    //  Sizes are zero if unknown
+    int decompress_input(Output& out, size_t input_size, size_t gzip_size);
+    size_t estimate_output_size(Format format, size_t input_size, size_t gzip_size) const;
+    int tokenize_input(TokenConsumer& consumer);
+    int process_blocks();
+    int check_trailer(bool verify_checksum);
 
-    int process_uncompressed_block();
-    int process_static_huffman_block();
-    int process_dynamic_huffman_block();
+    Format skip_wrapper();
+    Format skip_gzip_header();
+    Format skip_zlib_header(int method_and_info, int flags);
+
+    int process_uncompressed_block(bool is_final_block);
+    size_t stored_bytes_to_reference(size_t len, bool is_final_block);
+    int process_static_huffman_block(bool is_final_block);
+    int process_dynamic_huffman_block(bool is_final_block);
     int decompress_the_block();
+    template <bool tokenize, BlockKind kind> int decode_symbols();
+
+    int tokenize_stored_data(size_t len);
+    bool add_block_token(int type, bool is_final_block, const uint8_t* lengths, int literal_codes, int distance_codes);
+    bool next_token_batch();
+
+    bool make_room(size_t needed);
+    void limit_window(size_t needed);
+    void update_checksum();
 
     unsigned next_byte();
+    bool refill_input();
     void make_available(int count);
+    void refill_bits(int count);
     unsigned peek_bits(int count);
     void drop_bits(int count);
     unsigned get_bits(int count);
     void align_input();
+    void unread_bytes(const uint8_t* bytes, int count);
+    unsigned next_aligned_byte();
     unsigned read_le_uint16();
-    unsigned in_bytes_available();
+    uint32_t read_le_uint32();
+    uint32_t read_be_uint32();
+    size_t read_aligned_bytes(char* dest, size_t size);
+    size_t in_bytes_available();
 
     bool build_decode_tables(const uint8_t* lengths, int literals_size, int distances_size);
+    static bool build_uncached_decode_tables(
+        uint32_t* literal_length_table,
+        uint32_t* distance_table,
+        const uint8_t* lengths,
+        int literals_size,
+        int distances_size,
+        BlockKind& kind);
 
+    //  The current chunk of input. An in-memory input is a single chunk.
+    Input* m_source = nullptr;
+    bool m_source_persists = false;
+    const uint8_t* m_chunk_begin = nullptr;
     const uint8_t* m_input = nullptr;
     const uint8_t* m_input_end = nullptr;
 
-    unsigned m_bits = 0;
+    //  Number of zero bytes made up after the input ran out
+    int m_input_overrun = 0;
+
+    //  Size of the chunks before the current one
+    uint64_t m_earlier_chunks_size = 0;
+
+    bool m_trailing_data_allowed = false;
+    uint64_t m_input_consumed = 0;
+
+    uint64_t m_bits = 0;
     int m_bits_available = 0;
 
     uint32_t* m_code_length_decode_table = nullptr;
-    uint32_t* m_literal_length_decode_table = nullptr;
-    uint32_t* m_distance_decode_table = nullptr;
+    const uint32_t* m_literal_length_decode_table = nullptr;
+    const uint32_t* m_distance_decode_table = nullptr;
+    BlockKind m_block_kind = BlockKind::General;
+
+    Output* m_output = nullptr;
+    Window m_window;
+
+    //  Running checksum of the output up to m_checksum_next
+    Format m_format = Format::Invalid;
+    uint32_t m_checksum = 0;
+    const char* m_checksum_next = nullptr;
+    uint64_t m_output_size = 0;
+    bool m_checksum_enabled = true;
+
+    //  Decoding stops when the output reaches the limit
+    static constexpr uint64_t no_output_limit = ~uint64_t(0);
+    uint64_t m_output_limit = no_output_limit;
+    bool m_output_truncated = false;
+
+    //  The end of the window as the output has it, beyond the limit
+    char* m_output_end = nullptr;
+
+    //  Stored data that can't be needed for back-references is passed to the
+    //  output by reference. That's everything in a run of consecutive stored
+    //  blocks except the last 32 KiB before a compressed block.
+    bool m_references_accepted = false;
+    const uint8_t* m_stored_run_end = nullptr;
+    const uint8_t* m_stored_reference_end = nullptr;
+
+    //  Sizes for the three decode tables
+    static constexpr int code_length_table_size = 128;     // from zlib enough 19 7 7
+    static constexpr int literal_length_table_size = 1334; // from zlib enough 288 10 15
+    static constexpr int distance_table_size = 402;        // from zlib enough 32 8 15
 
-    std::vector<char>* m_out;
+    //  All the tables live right here, so a new object needs no allocations.
+    //  Left uninitialized on purpose: they get built before every use.
+    uint32_t m_tables[code_length_table_size + literal_length_table_size + distance_table_size];
 
-    std::vector<uint32_t> m_tables;
-    const char* m_error_message;
+    struct TableCache;
+    std::unique_ptr<TableCache> m_table_cache;
+
+    struct FixedHuffmanTables;
+    static const FixedHuffmanTables& fixed_huffman_tables();
+    bool m_table_cache_enabled = false;
+
+    SizeHintPolicy m_size_hint_policy;
+
+    //  Average of output size per input size, zero until something's been decompressed
+    double m_observed_ratio = 0;
+    TableCacheStatistics m_table_cache_statistics;
+
+    //  Tokens are passed in batches, allocated on first use.
+    //  While tokenizing, m_tokens points to them.
+    struct TokenPipeline;
+    std::unique_ptr<TokenPipeline> m_token_pipeline;
+    TokenPipeline* m_tokens = nullptr;
+
+    //  The window for verify, allocated on first use
+    std::vector<char> m_verify_buffer;
+
+    const char* m_error_message = nullptr;
 };
 
+
+//  One-shot decompression with the thread's own decompressor.
+//  Nothing needs to be set up or allocated for the call.
+//  DeflateDecompressor::thread_instance().error_message() tells more about errors.
+int deflate_decompress(const char* input, size_t size, std::vector<char>& out);
+int deflate_decompress(const char* input, size_t size, DeflateDecompressor::Output& out);
+
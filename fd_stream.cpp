@@ -0,0 +1,279 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "fd_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+    //  History that must stay available for back-references
+    constexpr size_t window_size = 32*1024;
+
+    //  Read until the buffer is full or the input ends, or until
+    //  stop_fd becomes readable. Returns the number of bytes read,
+    //  or -1 on errors.
+    ssize_t read_fully(int fd, int stop_fd, char* data, size_t size)
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            //  Wait for either, so that a read that would block can be given up
+            pollfd fds[2] = { { fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+            if (::poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return -1;
+            }
+
+            if (fds[1].revents)
+            {
+                break;
+            }
+
+            ssize_t count = ::read(fd, data + total, size - total);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return -1;
+            }
+
+            if (count == 0)
+            {
+                break;
+            }
+
+            total += size_t(count);
+        }
+
+        return ssize_t(total);
+    }
+
+} // namespace
+
+
+FdInput::FdInput(int fd, size_t chunk_size)
+    : m_fd(fd)
+{
+    for (Buffer& buffer : m_buffers)
+    {
+        buffer.data.resize(std::max<size_t>(chunk_size, 1));
+    }
+
+    if (::pipe(m_stop_pipe) == 0)
+    {
+        ::fcntl(m_stop_pipe[0], F_SETFD, FD_CLOEXEC);
+        ::fcntl(m_stop_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    m_thread = std::thread(&FdInput::read_ahead, this);
+}
+
+
+FdInput::~FdInput()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    //  Wake up the reader even if it's waiting for input that never comes
+    m_condition.notify_all();
+    if (m_stop_pipe[1] >= 0)
+    {
+        char byte = 0;
+        while (::write(m_stop_pipe[1], &byte, 1) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+    m_thread.join();
+
+    for (int fd : m_stop_pipe)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+}
+
+
+bool FdInput::failed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+}
+
+
+bool FdInput::next_chunk(const char*& data, size_t& size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    //  The previous chunk is no longer needed, so it can be read into again
+    if (m_current >= 0)
+    {
+        m_buffers[m_current].full = false;
+        m_current = -1;
+        m_condition.notify_all();
+    }
+
+    Buffer& buffer = m_buffers[m_next];
+    m_condition.wait(lock, [&]() { return buffer.full || m_ended; });
+    if (!buffer.full)
+    {
+        return false;
+    }
+
+    m_current = m_next;
+    m_next = (m_next + 1) % buffer_count;
+    data = buffer.data.data();
+    size = buffer.size;
+    return true;
+}
+
+
+//  Fill the buffers in turn, as soon as the decompressor lets go of them
+void FdInput::read_ahead()
+{
+    for (int index = 0; ; index = (index + 1) % buffer_count)
+    {
+        Buffer& buffer = m_buffers[index];
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [&]() { return !buffer.full || m_stopping; });
+            if (m_stopping)
+            {
+                return;
+            }
+        }
+
+        //  Nobody else touches a buffer that isn't full
+        ssize_t size = read_fully(m_fd, m_stop_pipe[0], buffer.data.data(), buffer.data.size());
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping)
+        {
+            return;
+        }
+
+        if (size > 0)
+        {
+            buffer.size = size_t(size);
+            buffer.full = true;
+        }
+
+        m_failed = (size < 0);
+        m_ended = (size < 0 || size_t(size) < buffer.data.size());
+        m_condition.notify_all();
+        if (m_ended)
+        {
+            return;
+        }
+    }
+}
+
+
+FdOutput::FdOutput(int fd, size_t buffer_size)
+    : m_fd(fd)
+{
+    //  Room for the history, and at least as much new data
+    m_buffer.resize(std::max(buffer_size, 2*window_size));
+}
+
+
+bool FdOutput::start(DeflateDecompressor::Window& window, size_t /*size_hint*/)
+{
+    m_written_mark = 0;
+    m_bytes_written = 0;
+
+    window.begin = m_buffer.data();
+    window.next = window.begin;
+    window.end = window.begin + m_buffer.size();
+    return true;
+}
+
+
+bool FdOutput::make_room(DeflateDecompressor::Window& window, size_t needed)
+{
+    if (size_t(window.end - window.next) >= needed)
+    {
+        return true;
+    }
+
+    if (!write_out(window.begin + m_written_mark, window.next - window.begin - m_written_mark))
+    {
+        return false;
+    }
+
+    //  Keep the last 32 KiB at the beginning of the buffer
+    size_t kept = std::min<size_t>(window.next - window.begin, window_size);
+    std::memmove(m_buffer.data(), window.next - kept, kept);
+
+    window.begin = m_buffer.data();
+    window.next = window.begin + kept;
+    window.end = window.begin + m_buffer.size();
+    m_written_mark = kept;
+    return true;
+}
+
+
+bool FdOutput::finish(DeflateDecompressor::Window& window)
+{
+    return write_out(window.begin + m_written_mark, window.next - window.begin - m_written_mark);
+}
+
+
+bool FdOutput::write_out(const char* data, size_t size)
+{
+    while (size)
+    {
+        ssize_t count = ::write(m_fd, data, size);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += count;
+        size -= size_t(count);
+        m_bytes_written += uint64_t(count);
+    }
+
+    return true;
+}
+
+
+int decompress_fd(DeflateDecompressor& deflate, int in_fd, int out_fd)
+{
+    FdInput input(in_fd);
+    FdOutput output(out_fd);
+
+    //  A read error looks like the input ending too soon
+    int err = deflate.decompress(input, output);
+    if (input.failed() && !err)
+    {
+        err = DeflateDecompressor::eInvalidInput;
+    }
+
+    return err;
+}
@@ -0,0 +1,103 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Streaming decompression between file descriptors.
+//
+//  Memory use stays the same no matter how big the data is: a few input
+//  buffers, and an output buffer that keeps only the 32 KiB window of
+//  history between large writes. Works with pipes and sockets as well as
+//  with files.
+//
+//  Available on POSIX systems only.
+//
+
+//  Input read from a file descriptor by a background thread, so that
+//  reading the next chunk overlaps with decompressing the current one.
+//  It can be destroyed before the input ends, even while the thread
+//  waits for more from a pipe or a socket.
+class FdInput : public DeflateDecompressor::Input
+{
+public:
+    explicit FdInput(int fd, size_t chunk_size = 128*1024);
+    ~FdInput();
+
+    FdInput(const FdInput&) = delete;
+    FdInput& operator=(const FdInput&) = delete;
+
+    //  True if reading failed. Otherwise the input simply ends.
+    bool failed() const;
+
+    //  The DeflateDecompressor::Input interface
+    bool next_chunk(const char*& data, size_t& size) override;
+
+private:
+    void read_ahead();
+
+    //  One buffer is being decompressed, one waits, and one is being read
+    static constexpr int buffer_count = 3;
+
+    struct Buffer
+    {
+        std::vector<char> data;
+        size_t size = 0;
+        bool full = false;
+    };
+
+    int m_fd;
+    Buffer m_buffers[buffer_count];
+
+    //  The buffer the decompressor has, or -1, and the one it gets next
+    int m_current = -1;
+    int m_next = 0;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_ended = false;
+    bool m_failed = false;
+    bool m_stopping = false;
+
+    //  Written to when stopping, to interrupt a read that's waiting for input
+    int m_stop_pipe[2] = { -1, -1 };
+
+    std::thread m_thread;
+};
+
+
+//  Output written to a file descriptor in large pieces
+class FdOutput : public DeflateDecompressor::Output
+{
+public:
+    explicit FdOutput(int fd, size_t buffer_size = 256*1024);
+
+    //  Number of bytes written so far
+    uint64_t bytes_written() const { return m_bytes_written; }
+
+    //  The DeflateDecompressor::Output interface
+    bool start(DeflateDecompressor::Window& window, size_t size_hint) override;
+    bool make_room(DeflateDecompressor::Window& window, size_t needed) override;
+    bool finish(DeflateDecompressor::Window& window) override;
+
+private:
+    bool write_out(const char* data, size_t size);
+
+    int m_fd;
+    std::vector<char> m_buffer;
+
+    //  Data in the buffer before this offset is already written
+    size_t m_written_mark = 0;
+    uint64_t m_bytes_written = 0;
+};
+
+
+//  Decompress everything from one file descriptor into another
+int decompress_fd(DeflateDecompressor& deflate, int in_fd, int out_fd);
@@ -0,0 +1,206 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "mapped_file_output.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+    size_t round_up_to_pages(size_t size)
+    {
+        static const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+        return (size + page_size - 1) & ~(page_size - 1);
+    }
+
+    //  Grow the file from old_size to size. The disk space is allocated right
+    //  away where possible, so that a full disk is an error here, and not a
+    //  SIGBUS when the data gets written through the mapping.
+    bool grow_file(int fd, size_t old_size, size_t size)
+    {
+#if defined(__linux__) || defined(__FreeBSD__)
+        if (size > old_size)
+        {
+            int err = ::posix_fallocate(fd, off_t(old_size), off_t(size - old_size));
+            if (err == 0)
+            {
+                return true;
+            }
+
+            //  Only a file system that can't do it gets the sparse file
+            if (err != EINVAL && err != EOPNOTSUPP)
+            {
+                return false;
+            }
+        }
+#else
+        (void)old_size;
+#endif
+
+        return ::ftruncate(fd, off_t(size)) == 0;
+    }
+
+} // namespace
+
+
+MappedFileOutput::~MappedFileOutput()
+{
+    close();
+}
+
+
+bool MappedFileOutput::open(const char* path)
+{
+    close();
+
+    m_failed = false;
+    m_size = 0;
+    m_fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return m_fd >= 0;
+}
+
+
+bool MappedFileOutput::close()
+{
+    unmap();
+
+    if (m_fd >= 0 && ::close(m_fd) != 0)
+    {
+        m_failed = true;
+    }
+
+    m_fd = -1;
+    return !m_failed;
+}
+
+
+bool MappedFileOutput::start(DeflateDecompressor::Window& window, size_t size_hint)
+{
+    if (m_fd < 0)
+    {
+        return false;
+    }
+
+    unmap();
+    m_size = 0;
+
+    //  Even an exact hint needs a little extra, because the
+    //  decompressor wants room for a full match at the end.
+    size_t size = size_hint ? size_hint + 4096 : m_growth_step;
+    if (!map(size))
+    {
+        return false;
+    }
+
+    window.begin = m_mapping;
+    window.next = m_mapping;
+    window.end = m_mapping + m_mapped_size;
+    return true;
+}
+
+
+bool MappedFileOutput::make_room(DeflateDecompressor::Window& window, size_t needed)
+{
+    size_t used = window.next - window.begin;
+    size_t size = std::max(m_mapped_size + m_growth_step, used + needed);
+    if (!map(size))
+    {
+        return false;
+    }
+
+    window.begin = m_mapping;
+    window.next = m_mapping + used;
+    window.end = m_mapping + m_mapped_size;
+    return true;
+}
+
+
+bool MappedFileOutput::finish(DeflateDecompressor::Window& window)
+{
+    m_size = window.next - window.begin;
+    unmap();
+
+    if (::ftruncate(m_fd, off_t(m_size)) != 0)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+
+//  Extend the file, and map it with at least the given size.
+//  The existing contents stay in place, but the mapping may move.
+bool MappedFileOutput::map(size_t size)
+{
+    size = round_up_to_pages(size);
+    if (!grow_file(m_fd, m_mapped_size, size))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    void* mapping = MAP_FAILED;
+
+#ifdef MREMAP_MAYMOVE
+    if (m_mapping)
+    {
+        mapping = ::mremap(m_mapping, m_mapped_size, size, MREMAP_MAYMOVE);
+    }
+#else
+    unmap();
+#endif
+
+    if (!m_mapping)
+    {
+        mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    }
+
+    if (mapping == MAP_FAILED)
+    {
+        unmap();
+        m_failed = true;
+        return false;
+    }
+
+    m_mapping = static_cast<char*>(mapping);
+    m_mapped_size = size;
+    return true;
+}
+
+
+void MappedFileOutput::unmap()
+{
+    if (m_mapping)
+    {
+        ::munmap(m_mapping, m_mapped_size);
+    }
+
+    m_mapping = nullptr;
+    m_mapped_size = 0;
+}
+
+
+int decompress_to_file(DeflateDecompressor& deflate, const char* input, size_t size, const char* path)
+{
+    MappedFileOutput output;
+    if (!output.open(path))
+    {
+        return DeflateDecompressor::eOutputError;
+    }
+
+    int err = deflate.decompress(input, size, output);
+    if (!output.close() && !err)
+    {
+        err = DeflateDecompressor::eOutputError;
+    }
+
+    return err;
+}
@@ -0,0 +1,60 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+//  Decompress directly into a memory mapped file.
+//
+//  The file is sized from the gzip ISIZE when it's available, or grown in
+//  large steps otherwise, and the decompressor writes straight into the
+//  mapping. The disk space is allocated as the file grows, so running out
+//  of it is an output error. Back-references read from the mapped pages,
+//  and the file is truncated to the final size at the end. No heap buffer
+//  holds the output, and every output byte gets written only once.
+//
+//  Available on POSIX systems only.
+//
+class MappedFileOutput : public DeflateDecompressor::Output
+{
+public:
+    MappedFileOutput() = default;
+    ~MappedFileOutput();
+
+    MappedFileOutput(const MappedFileOutput&) = delete;
+    MappedFileOutput& operator=(const MappedFileOutput&) = delete;
+
+    //  Create the file, or truncate an existing one
+    bool open(const char* path);
+
+    //  Close the file. Returns false if anything failed along the way.
+    bool close();
+
+    //  How much to grow the file at a time when its final size isn't known
+    void set_growth_step(size_t step) { m_growth_step = step; }
+
+    //  Size of the output after a successful decompress
+    size_t size() const { return m_size; }
+
+    //  The DeflateDecompressor::Output interface
+    bool start(DeflateDecompressor::Window& window, size_t size_hint) override;
+    bool make_room(DeflateDecompressor::Window& window, size_t needed) override;
+    bool finish(DeflateDecompressor::Window& window) override;
+
+private:
+    bool map(size_t size);
+    void unmap();
+
+    int m_fd = -1;
+    char* m_mapping = nullptr;
+    size_t m_mapped_size = 0;
+    size_t m_size = 0;
+    size_t m_growth_step = 64*1024*1024;
+    bool m_failed = false;
+};
+
+
+//  Decompress the input into the named file
+int decompress_to_file(DeflateDecompressor& deflate, const char* input, size_t size, const char* path);
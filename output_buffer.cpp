@@ -0,0 +1,385 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "output_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef OUTPUT_BUFFER_HAS_HUGE_PAGES
+#include <cstdint>
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+    //  Smallest buffer worth allocating
+    constexpr size_t min_buffer_size = 16*1024;
+
+    class NewDeleteArena : public OutputArena
+    {
+    public:
+        void* allocate(size_t size) override
+        {
+            return ::operator new(size, std::nothrow);
+        }
+
+        void deallocate(void* ptr, size_t) override
+        {
+            ::operator delete(ptr);
+        }
+    };
+
+} // namespace
+
+
+OutputArena* OutputArena::default_arena()
+{
+    static NewDeleteArena arena;
+    return &arena;
+}
+
+
+#ifdef __cpp_lib_memory_resource
+
+void* PmrArena::allocate(size_t size)
+{
+    try
+    {
+        return m_resource->allocate(size);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return nullptr;
+    }
+}
+
+
+void PmrArena::deallocate(void* ptr, size_t size)
+{
+    m_resource->deallocate(ptr, size);
+}
+
+#endif
+
+
+#ifdef OUTPUT_BUFFER_HAS_HUGE_PAGES
+
+namespace {
+
+    size_t round_to_huge_page(size_t size)
+    {
+        constexpr size_t mask = HugePageArena::huge_page_size - 1;
+        return (size + mask) & ~mask;
+    }
+
+    //  Fault in the pages now, writable, so that the decoder doesn't take
+    //  the faults one at a time. MAP_POPULATE would do this already in mmap,
+    //  before MADV_HUGEPAGE could have any effect on the pages.
+    void populate(char* data, size_t size)
+    {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(data, size, MADV_POPULATE_WRITE) == 0)
+        {
+            return;
+        }
+#endif
+
+        //  Older kernels. Touching one byte is enough for a whole huge page,
+        //  but the pages may have turned out small.
+        for (size_t ix = 0; ix < size; ix += 4096)
+        {
+            data[ix] = 0;
+        }
+    }
+
+} // namespace
+
+
+void* HugePageArena::allocate(size_t size)
+{
+    if (!is_mapped(size))
+    {
+        return ::operator new(size, std::nothrow);
+    }
+
+    //  Map an extra huge page, and trim the ends to get the alignment
+    size_t length = round_to_huge_page(size);
+    size_t mapped_length = length + huge_page_size;
+    void* mapping = mmap(nullptr, mapped_length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    char* start = static_cast<char*>(mapping);
+    char* data = start + (round_to_huge_page(uintptr_t(start)) - uintptr_t(start));
+    if (data != start)
+    {
+        munmap(start, data - start);
+    }
+
+    char* end = start + mapped_length;
+    if (data + length != end)
+    {
+        munmap(data + length, end - (data + length));
+    }
+
+    madvise(data, length, MADV_HUGEPAGE);
+    if (m_populate)
+    {
+        populate(data, length);
+    }
+
+    return data;
+}
+
+
+void HugePageArena::deallocate(void* ptr, size_t size)
+{
+    if (!is_mapped(size))
+    {
+        ::operator delete(ptr);
+        return;
+    }
+
+    munmap(ptr, round_to_huge_page(size));
+}
+
+
+size_t HugePageArena::good_size(size_t size) const
+{
+    return is_mapped(size) ? round_to_huge_page(size) : size;
+}
+
+#endif
+
+
+OutputBuffer::OutputBuffer(OutputArena* arena)
+    : m_arena(arena ? arena : OutputArena::default_arena())
+{
+}
+
+
+OutputBuffer::~OutputBuffer()
+{
+    release();
+}
+
+
+OutputBuffer::OutputBuffer(OutputBuffer&& other) noexcept
+    : m_arena(other.m_arena)
+    , m_data(other.m_data)
+    , m_size(other.m_size)
+    , m_capacity(other.m_capacity)
+{
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_capacity = 0;
+}
+
+
+OutputBuffer& OutputBuffer::operator=(OutputBuffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        m_arena = other.m_arena;
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_capacity = other.m_capacity;
+        other.m_data = nullptr;
+        other.m_size = 0;
+        other.m_capacity = 0;
+    }
+
+    return *this;
+}
+
+
+bool OutputBuffer::reserve(size_t capacity)
+{
+    if (capacity <= m_capacity)
+    {
+        return true;
+    }
+
+    capacity = m_arena->good_size(capacity);
+    char* data = static_cast<char*>(m_arena->allocate(capacity));
+    if (!data)
+    {
+        return false;
+    }
+
+    if (m_size)
+    {
+        std::memcpy(data, m_data, m_size);
+    }
+
+    if (m_data)
+    {
+        m_arena->deallocate(m_data, m_capacity);
+    }
+
+    m_data = data;
+    m_capacity = capacity;
+    return true;
+}
+
+
+void OutputBuffer::release()
+{
+    if (m_data)
+    {
+        m_arena->deallocate(m_data, m_capacity);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_capacity = 0;
+}
+
+
+bool OutputBuffer::start(DeflateDecompressor::Window& window, size_t size_hint)
+{
+    clear();
+    if (!reserve(size_hint ? size_hint + match_room : 0))
+    {
+        return false;
+    }
+
+    set_window(window, 0);
+    return true;
+}
+
+
+bool OutputBuffer::make_room(DeflateDecompressor::Window& window, size_t needed)
+{
+    //  Only the used part gets copied if the buffer moves
+    m_size = window.next - window.begin;
+
+    size_t capacity = std::max(2*m_capacity, m_size + needed);
+    if (!reserve(std::max(capacity, min_buffer_size)))
+    {
+        return false;
+    }
+
+    set_window(window, m_size);
+    return true;
+}
+
+
+bool OutputBuffer::finish(DeflateDecompressor::Window& window)
+{
+    m_size = window.next - window.begin;
+    return true;
+}
+
+
+void OutputBuffer::set_window(DeflateDecompressor::Window& window, size_t used)
+{
+    window.begin = m_data;
+    window.next = m_data + used;
+    window.end = m_data + m_capacity;
+}
+
+
+BufferPool::BufferPool(size_t max_cached_bytes)
+    : m_max_cached_bytes(max_cached_bytes)
+{
+}
+
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+
+int BufferPool::size_class(size_t size)
+{
+    int bits = min_class_bits;
+    while (bits < min_class_bits + class_count && (size_t(1) << bits) < size)
+    {
+        ++bits;
+    }
+
+    return bits - min_class_bits;
+}
+
+
+size_t BufferPool::good_size(size_t size) const
+{
+    int index = size_class(size);
+    if (index >= class_count)
+    {
+        return size;
+    }
+
+    return size_t(1) << (index + min_class_bits);
+}
+
+
+void* BufferPool::allocate(size_t size)
+{
+    int index = size_class(size);
+    if (index < class_count)
+    {
+        std::vector<void*>& free_list = m_free_lists[index];
+        if (!free_list.empty())
+        {
+            void* ptr = free_list.back();
+            free_list.pop_back();
+            m_cached_bytes -= good_size(size);
+            ++m_reused_allocations;
+            return ptr;
+        }
+
+        size = good_size(size);
+    }
+
+    ++m_system_allocations;
+    return ::operator new(size, std::nothrow);
+}
+
+
+void BufferPool::deallocate(void* ptr, size_t size)
+{
+    int index = size_class(size);
+    size_t class_size = good_size(size);
+    if (index < class_count && m_cached_bytes + class_size <= m_max_cached_bytes)
+    {
+        m_free_lists[index].push_back(ptr);
+        m_cached_bytes += class_size;
+        return;
+    }
+
+    ::operator delete(ptr);
+}
+
+
+OutputBuffer BufferPool::acquire(size_t size_hint)
+{
+    OutputBuffer buffer(this);
+    buffer.reserve(size_hint);
+    return buffer;
+}
+
+
+void BufferPool::trim()
+{
+    for (std::vector<void*>& free_list : m_free_lists)
+    {
+        for (void* ptr : free_list)
+        {
+            ::operator delete(ptr);
+        }
+
+        free_list.clear();
+    }
+
+    m_cached_bytes = 0;
+}
@@ -0,0 +1,193 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+#include <cstddef>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
+#if defined(__linux__) && __has_include(<sys/mman.h>)
+#define OUTPUT_BUFFER_HAS_HUGE_PAGES
+#endif
+
+//  Source of raw memory for output buffers.
+//  The interface follows std::pmr::memory_resource, so any kind of arena
+//  can be plugged in without dragging the whole pmr machinery along.
+class OutputArena
+{
+public:
+    virtual ~OutputArena() = default;
+
+    //  Returns nullptr if the memory isn't available
+    virtual void* allocate(size_t size) = 0;
+    virtual void deallocate(void* ptr, size_t size) = 0;
+
+    //  The size an allocation of the given size would actually get.
+    //  Lets the buffers make use of any rounding up done by the arena.
+    virtual size_t good_size(size_t size) const { return size; }
+
+    //  Plain operator new and delete
+    static OutputArena* default_arena();
+};
+
+
+#ifdef __cpp_lib_memory_resource
+
+//  Adapter for a standard polymorphic memory resource
+class PmrArena : public OutputArena
+{
+public:
+    explicit PmrArena(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource) {}
+
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr, size_t size) override;
+
+private:
+    std::pmr::memory_resource* m_resource;
+};
+
+#endif
+
+
+#ifdef OUTPUT_BUFFER_HAS_HUGE_PAGES
+
+//  Memory for large outputs straight from the kernel, aligned to 2 MiB
+//  and marked for transparent huge pages. An output of hundreds of
+//  megabytes then takes one page fault and one TLB entry per 2 MiB
+//  instead of per 4 KiB. Smaller allocations use operator new.
+//
+//  Huge pages still depend on the system setting in
+//  /sys/kernel/mm/transparent_hugepage/enabled being "always" or "madvise".
+class HugePageArena : public OutputArena
+{
+public:
+    //  Allocations of at least 'threshold' bytes are mapped. With 'populate',
+    //  the pages are faulted in right away, which pays off when the whole
+    //  size is known up front, as it usually is from the gzip size field.
+    explicit HugePageArena(size_t threshold = 8*1024*1024, bool populate = false)
+        : m_threshold(threshold), m_populate(populate) {}
+
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr, size_t size) override;
+    size_t good_size(size_t size) const override;
+
+    static constexpr size_t huge_page_size = 2*1024*1024;
+
+private:
+    bool is_mapped(size_t size) const { return size >= m_threshold; }
+
+    size_t m_threshold;
+    bool m_populate;
+};
+
+#endif
+
+
+//  A growable buffer for the decompressed data, with memory from an arena.
+//  Unlike std::vector<char>, it never zero fills memory that's about to be
+//  overwritten anyway. Clearing keeps the memory for reuse.
+class OutputBuffer : public DeflateDecompressor::Output
+{
+public:
+    explicit OutputBuffer(OutputArena* arena = nullptr);
+    ~OutputBuffer();
+
+    OutputBuffer(OutputBuffer&& other) noexcept;
+    OutputBuffer& operator=(OutputBuffer&& other) noexcept;
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    char* data() { return m_data; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+
+    OutputArena* arena() const { return m_arena; }
+
+    //  Make the size zero, but keep the memory
+    void clear() { m_size = 0; }
+
+    //  Make sure the capacity is at least the given size
+    bool reserve(size_t capacity);
+
+    //  Give the memory back to the arena
+    void release();
+
+    //  The DeflateDecompressor::Output interface
+    bool start(DeflateDecompressor::Window& window, size_t size_hint) override;
+    bool make_room(DeflateDecompressor::Window& window, size_t needed) override;
+    bool finish(DeflateDecompressor::Window& window) override;
+
+private:
+    void set_window(DeflateDecompressor::Window& window, size_t used);
+
+    OutputArena* m_arena;
+    char* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_capacity = 0;
+};
+
+
+//  A pool of size classed buffers.
+//
+//  Sizes are rounded up to a power of two, and freed buffers are kept on
+//  a free list of their size class. A steady-state workload that keeps
+//  getting and returning similar sizes never goes back to malloc and free,
+//  and keeps reusing memory that is already paged in.
+//
+//  Not thread safe. Use one pool per thread.
+class BufferPool : public OutputArena
+{
+public:
+    //  Freed buffers beyond the byte limit are given back to the system
+    explicit BufferPool(size_t max_cached_bytes = 256*1024*1024);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr, size_t size) override;
+    size_t good_size(size_t size) const override;
+
+    //  An empty buffer that allocates from this pool, with memory
+    //  for at least size_hint bytes already in place.
+    OutputBuffer acquire(size_t size_hint = 0);
+
+    //  Give all the cached buffers back to the system
+    void trim();
+
+    //  Number of allocations that had to go to the system
+    size_t system_allocations() const { return m_system_allocations; }
+
+    //  Number of allocations served from the free lists
+    size_t reused_allocations() const { return m_reused_allocations; }
+
+    size_t cached_bytes() const { return m_cached_bytes; }
+
+private:
+    static constexpr int min_class_bits = 12;   // 4 KiB
+    static constexpr int class_count = 40;
+
+    static int size_class(size_t size);
+
+    std::vector<void*> m_free_lists[class_count];
+
+    size_t m_max_cached_bytes;
+    size_t m_cached_bytes = 0;
+    size_t m_system_allocations = 0;
+    size_t m_reused_allocations = 0;
+};
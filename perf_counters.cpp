@@ -0,0 +1,185 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    const char* const counter_names[PerfCounters::CounterCount] = {
+        "cycles",
+        "instructions",
+        "branch-misses",
+        "L1d-misses",
+        "LLC-misses",
+        "dTLB-misses",
+        "page-faults",
+    };
+
+#ifdef __linux__
+
+    constexpr uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+    {
+        return cache | (op << 8) | (result << 16);
+    }
+
+    struct EventType
+    {
+        uint32_t type;
+        uint64_t config;
+    };
+
+    const EventType event_types[PerfCounters::CounterCount] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, cache_event(
+            PERF_COUNT_HW_CACHE_L1D,
+            PERF_COUNT_HW_CACHE_OP_READ,
+            PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { PERF_TYPE_HW_CACHE, cache_event(
+            PERF_COUNT_HW_CACHE_LL,
+            PERF_COUNT_HW_CACHE_OP_READ,
+            PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { PERF_TYPE_HW_CACHE, cache_event(
+            PERF_COUNT_HW_CACHE_DTLB,
+            PERF_COUNT_HW_CACHE_OP_READ,
+            PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    };
+
+    int open_event(const EventType& event)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = event.type;
+        attr.config = event.config;
+
+        //  Count only this process in user mode. Anything more
+        //  requires privileges that normal users don't have.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        return int(fd);
+    }
+
+#endif
+
+}
+
+
+PerfCounters::~PerfCounters()
+{
+    close();
+}
+
+
+bool PerfCounters::open()
+{
+    close();
+
+#ifdef __linux__
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+        m_fds[ix] = open_event(event_types[ix]);
+    }
+#endif
+
+    reset();
+    return any_available();
+}
+
+
+void PerfCounters::close()
+{
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+#ifdef __linux__
+        if (m_fds[ix] >= 0)
+        {
+            ::close(m_fds[ix]);
+        }
+#endif
+        m_fds[ix] = -1;
+    }
+}
+
+
+bool PerfCounters::any_available() const
+{
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+        if (available(ix))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void PerfCounters::start()
+{
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+        m_start[ix] = read_counter(ix);
+    }
+}
+
+
+void PerfCounters::stop()
+{
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+        m_totals[ix] += read_counter(ix) - m_start[ix];
+    }
+}
+
+
+void PerfCounters::reset()
+{
+    for (int ix = 0; ix < CounterCount; ++ix)
+    {
+        m_start[ix] = 0;
+        m_totals[ix] = 0;
+    }
+}
+
+
+const char* PerfCounters::name(int counter)
+{
+    if (counter < 0 || counter >= CounterCount)
+    {
+        return "";
+    }
+
+    return counter_names[counter];
+}
+
+
+uint64_t PerfCounters::read_counter(int counter) const
+{
+    uint64_t value = 0;
+
+#ifdef __linux__
+    int fd = m_fds[counter];
+    if (fd >= 0 && ::read(fd, &value, sizeof value) != sizeof value)
+    {
+        value = 0;
+    }
+#else
+    (void)counter;
+#endif
+
+    return value;
+}
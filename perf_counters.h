@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include <cstdint>
+
+//  Hardware performance counters for the benchmarks.
+//
+//  Uses perf_event_open on Linux. On other systems, or if the kernel
+//  doesn't permit access to the counters (see perf_event_paranoid),
+//  the counters simply stay unavailable and read as zero.
+//
+class PerfCounters
+{
+public:
+    enum Counter {
+        Cycles,
+        Instructions,
+        BranchMisses,
+        L1dMisses,
+        LlcMisses,
+        DtlbMisses,
+        PageFaults,
+        CounterCount,
+    };
+
+    PerfCounters() = default;
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    //  Try to open all the counters.
+    //  Returns true if at least one of them could be opened.
+    bool open();
+    void close();
+
+    //  True if the counter could be opened
+    bool available(int counter) const { return m_fds[counter] >= 0; }
+    bool any_available() const;
+
+    //  Accumulate the counts between start and stop.
+    void start();
+    void stop();
+
+    //  Clear the accumulated counts
+    void reset();
+
+    uint64_t value(int counter) const { return m_totals[counter]; }
+
+    static const char* name(int counter);
+
+private:
+    uint64_t read_counter(int counter) const;
+
+    int m_fds[CounterCount] = { -1, -1, -1, -1, -1, -1, -1 };
+    uint64_t m_start[CounterCount] = {};
+    uint64_t m_totals[CounterCount] = {};
+};
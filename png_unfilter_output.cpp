@@ -0,0 +1,362 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "png_unfilter_output.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef PNG_UNFILTER_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+    constexpr size_t window_size = 32*1024;
+
+    //  Filtered data beyond the history is processed this much at a time
+    constexpr size_t chunk_size = 32*1024;
+
+    enum FilterType
+    {
+        kNone,
+        kSub,
+        kUp,
+        kAverage,
+        kPaeth,
+    };
+
+
+    int paeth_predictor(int a, int b, int c)
+    {
+        int pa = std::abs(b - c);
+        int pb = std::abs(a - c);
+        int pc = std::abs(a + b - 2*c);
+        if (pa <= pb && pa <= pc)
+        {
+            return a;
+        }
+
+        return (pb <= pc) ? b : c;
+    }
+
+
+    //  Add the bytes above, starting from an offset
+    void unfilter_up(const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size, size_t ix)
+    {
+        for (; ix < size; ++ix)
+        {
+            dest[ix] = uint8_t(src[ix] + prior[ix]);
+        }
+    }
+
+
+    //  The plain versions work with any number of bytes per pixel
+    void unfilter_row(int type, const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size, size_t bpp)
+    {
+        size_t lead = std::min(bpp, size);
+        switch (type)
+        {
+        case kSub:
+            std::memcpy(dest, src, lead);
+            for (size_t ix = lead; ix < size; ++ix)
+            {
+                dest[ix] = uint8_t(src[ix] + dest[ix - bpp]);
+            }
+            break;
+
+        case kUp:
+            unfilter_up(src, prior, dest, size, 0);
+            break;
+
+        case kAverage:
+            for (size_t ix = 0; ix < lead; ++ix)
+            {
+                dest[ix] = uint8_t(src[ix] + (prior[ix] >> 1));
+            }
+
+            for (size_t ix = lead; ix < size; ++ix)
+            {
+                dest[ix] = uint8_t(src[ix] + ((dest[ix - bpp] + prior[ix]) >> 1));
+            }
+            break;
+
+        case kPaeth:
+            for (size_t ix = 0; ix < lead; ++ix)
+            {
+                dest[ix] = uint8_t(src[ix] + prior[ix]);
+            }
+
+            for (size_t ix = lead; ix < size; ++ix)
+            {
+                dest[ix] = uint8_t(src[ix] + paeth_predictor(dest[ix - bpp], prior[ix], prior[ix - bpp]));
+            }
+            break;
+
+        default:
+            std::memcpy(dest, src, size);
+            break;
+        }
+    }
+
+#ifdef PNG_UNFILTER_HAS_SSE2
+
+    //  Three and four byte pixels are handled a pixel at a time in
+    //  a vector register, which is where most of the time goes for
+    //  RGB and RGBA images. The data dependency from one pixel to the
+    //  next only allows parallelism within a pixel.
+
+    template<int bpp>
+    __m128i load_pixel(const uint8_t* p)
+    {
+        int value = 0;
+        std::memcpy(&value, p, bpp);
+        return _mm_cvtsi32_si128(value);
+    }
+
+    template<int bpp>
+    void store_pixel(uint8_t* p, __m128i pixel)
+    {
+        int value = _mm_cvtsi128_si32(pixel);
+        std::memcpy(p, &value, bpp);
+    }
+
+    __m128i if_then_else(__m128i condition, __m128i a, __m128i b)
+    {
+        return _mm_or_si128(_mm_and_si128(condition, a), _mm_andnot_si128(condition, b));
+    }
+
+    __m128i abs_i16(__m128i x)
+    {
+        return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+    }
+
+    void unfilter_up_sse2(const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size)
+    {
+        size_t ix = 0;
+        for (; ix + 16 <= size; ix += 16)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ix));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + ix));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + ix), _mm_add_epi8(x, b));
+        }
+
+        unfilter_up(src, prior, dest, size, ix);
+    }
+
+    template<int bpp>
+    void unfilter_sub_sse2(const uint8_t* src, uint8_t* dest, size_t size)
+    {
+        __m128i a = _mm_setzero_si128();
+        for (size_t ix = 0; ix < size; ix += bpp)
+        {
+            a = _mm_add_epi8(a, load_pixel<bpp>(src + ix));
+            store_pixel<bpp>(dest + ix, a);
+        }
+    }
+
+    template<int bpp>
+    void unfilter_average_sse2(const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size)
+    {
+        //  _mm_avg_epu8 rounds up, so the low bit of a+b has to be taken off
+        const __m128i ones = _mm_set1_epi8(1);
+        __m128i a = _mm_setzero_si128();
+        for (size_t ix = 0; ix < size; ix += bpp)
+        {
+            __m128i b = load_pixel<bpp>(prior + ix);
+            __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+            a = _mm_add_epi8(load_pixel<bpp>(src + ix), average);
+            store_pixel<bpp>(dest + ix, a);
+        }
+    }
+
+    template<int bpp>
+    void unfilter_paeth_sse2(const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size)
+    {
+        //  The predictor needs nine bits, so work on 16-bit lanes.
+        //  With p = a + b - c, the distances are |b - c|, |a - c|, and |a + b - 2c|.
+        const __m128i zero = _mm_setzero_si128();
+        __m128i a = zero;
+        __m128i c = zero;
+        for (size_t ix = 0; ix < size; ix += bpp)
+        {
+            __m128i b = _mm_unpacklo_epi8(load_pixel<bpp>(prior + ix), zero);
+            __m128i x = load_pixel<bpp>(src + ix);
+
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = abs_i16(_mm_add_epi16(pa, pb));
+            pa = abs_i16(pa);
+            pb = abs_i16(pb);
+
+            __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            __m128i nearest = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+            x = _mm_add_epi8(x, _mm_packus_epi16(nearest, nearest));
+            store_pixel<bpp>(dest + ix, x);
+
+            a = _mm_unpacklo_epi8(x, zero);
+            c = b;
+        }
+    }
+
+    template<int bpp>
+    void unfilter_pixels_sse2(int type, const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size)
+    {
+        switch (type)
+        {
+        case kSub:
+            unfilter_sub_sse2<bpp>(src, dest, size);
+            break;
+
+        case kAverage:
+            unfilter_average_sse2<bpp>(src, prior, dest, size);
+            break;
+
+        case kPaeth:
+            unfilter_paeth_sse2<bpp>(src, prior, dest, size);
+            break;
+
+        default:
+            unfilter_row(type, src, prior, dest, size, bpp);
+            break;
+        }
+    }
+
+#endif
+
+    void unfilter(int type, const uint8_t* src, const uint8_t* prior, uint8_t* dest, size_t size, size_t bpp)
+    {
+#ifdef PNG_UNFILTER_HAS_SSE2
+        if (type == kUp)
+        {
+            unfilter_up_sse2(src, prior, dest, size);
+            return;
+        }
+
+        //  Whole pixels only, so the last one doesn't go past the row
+        if (size % bpp == 0)
+        {
+            if (bpp == 3)
+            {
+                unfilter_pixels_sse2<3>(type, src, prior, dest, size);
+                return;
+            }
+
+            if (bpp == 4)
+            {
+                unfilter_pixels_sse2<4>(type, src, prior, dest, size);
+                return;
+            }
+        }
+#endif
+
+        unfilter_row(type, src, prior, dest, size, bpp);
+    }
+
+} // namespace
+
+
+PngUnfilterOutput::PngUnfilterOutput(char* pixels, size_t stride, size_t row_size, int bytes_per_pixel, size_t row_count)
+    : m_pixels(pixels)
+    , m_stride(stride)
+    , m_row_size(row_size)
+    , m_bytes_per_pixel(std::max(bytes_per_pixel, 1))
+    , m_row_count(row_count)
+    , m_zero_row(row_size)
+{
+}
+
+
+bool PngUnfilterOutput::start(DeflateDecompressor::Window& window, size_t /*size_hint*/)
+{
+    m_row_mark = 0;
+    m_rows_done = 0;
+    m_failed = false;
+
+    //  Room for the history, a partial row, and a chunk of new data
+    m_buffer.resize(window_size + m_row_size + 1 + chunk_size);
+
+    window.begin = m_buffer.data();
+    window.next = window.begin;
+    window.end = window.begin + m_buffer.size();
+    return true;
+}
+
+
+bool PngUnfilterOutput::make_room(DeflateDecompressor::Window& window, size_t needed)
+{
+    if (size_t(window.end - window.next) >= needed)
+    {
+        return true;
+    }
+
+    if (!unfilter_rows(window))
+    {
+        return false;
+    }
+
+    //  Keep the last 32 KiB, and the row being filled in
+    size_t used = window.next - window.begin;
+    size_t keep_from = std::min(used - std::min(used, window_size), m_row_mark);
+    size_t kept = used - keep_from;
+    std::memmove(m_buffer.data(), m_buffer.data() + keep_from, kept);
+    m_row_mark -= keep_from;
+
+    if (m_buffer.size() - kept < needed)
+    {
+        m_buffer.resize(kept + needed);
+    }
+
+    window.begin = m_buffer.data();
+    window.next = window.begin + kept;
+    window.end = window.begin + m_buffer.size();
+    return true;
+}
+
+
+bool PngUnfilterOutput::finish(DeflateDecompressor::Window& window)
+{
+    //  Anything after the last complete row is a problem
+    if (!unfilter_rows(window) || m_rows_done != m_row_count
+        || window.begin + m_row_mark != window.next)
+    {
+        m_failed = true;
+    }
+
+    return !m_failed;
+}
+
+
+bool PngUnfilterOutput::unfilter_rows(const DeflateDecompressor::Window& window)
+{
+    size_t used = window.next - window.begin;
+    while (used - m_row_mark > m_row_size)
+    {
+        if (m_rows_done == m_row_count)
+        {
+            m_failed = true;
+            return false;
+        }
+
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(window.begin + m_row_mark);
+        int type = *src++;
+        if (type > kPaeth)
+        {
+            m_failed = true;
+            return false;
+        }
+
+        uint8_t* dest = reinterpret_cast<uint8_t*>(m_pixels + m_rows_done*m_stride);
+        const char* prior = m_rows_done ? m_pixels + (m_rows_done - 1)*m_stride : m_zero_row.data();
+        unfilter(type, src, reinterpret_cast<const uint8_t*>(prior), dest, m_row_size, m_bytes_per_pixel);
+
+        m_row_mark += m_row_size + 1;
+        ++m_rows_done;
+    }
+
+    return true;
+}
@@ -0,0 +1,64 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PNG_UNFILTER_HAS_SSE2
+#endif
+
+//  Output for the zlib stream of a PNG image, undoing the row filters
+//  on the fly and writing the final pixel rows into a caller's buffer.
+//
+//  Each filtered row is one filter type byte followed by the row data.
+//  A row is unfiltered as soon as the window has been filled past it,
+//  while it and the row above it are still in the cache, so the image
+//  never exists in its filtered form as a whole.
+//
+//  Bytes per pixel is rounded up to one for bit depths below eight, as
+//  the filters do. Interlaced images need a separate output per pass.
+//
+class PngUnfilterOutput : public DeflateDecompressor::Output
+{
+public:
+    //  Rows of row_size bytes each, not counting the filter type bytes,
+    //  go to 'pixels' with 'stride' bytes from the start of one to the next.
+    PngUnfilterOutput(char* pixels, size_t stride, size_t row_size, int bytes_per_pixel, size_t row_count);
+
+    //  Rows written into the pixel buffer so far
+    size_t rows_done() const { return m_rows_done; }
+
+    //  Set when the data didn't fit the image, or had an invalid filter type
+    bool failed() const { return m_failed; }
+
+    //  The DeflateDecompressor::Output interface
+    bool start(DeflateDecompressor::Window& window, size_t size_hint) override;
+    bool make_room(DeflateDecompressor::Window& window, size_t needed) override;
+    bool finish(DeflateDecompressor::Window& window) override;
+
+private:
+    //  Unfilter all complete rows in the window
+    bool unfilter_rows(const DeflateDecompressor::Window& window);
+
+    char* m_pixels;
+    size_t m_stride;
+    size_t m_row_size;
+    int m_bytes_per_pixel;
+    size_t m_row_count;
+
+    std::vector<char> m_buffer;
+
+    //  Stands in for the row above the first one
+    std::vector<char> m_zero_row;
+
+    //  Offset of the first row in the buffer that's still filtered
+    size_t m_row_mark = 0;
+
+    size_t m_rows_done = 0;
+    bool m_failed = false;
+};
@@ -0,0 +1,150 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "segmented_output.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#ifdef SEGMENTED_OUTPUT_HAS_IOVEC
+#include <climits>
+#include <unistd.h>
+#endif
+
+SegmentedOutput::SegmentedOutput(OutputArena* arena)
+    : m_buffer(arena)
+{
+}
+
+
+bool SegmentedOutput::start(DeflateDecompressor::Window& window, size_t size_hint)
+{
+    m_pieces.clear();
+    m_segments.clear();
+    m_owned_mark = 0;
+    m_size = 0;
+    m_referenced_size = 0;
+
+    return m_buffer.start(window, size_hint);
+}
+
+
+bool SegmentedOutput::make_room(DeflateDecompressor::Window& window, size_t needed)
+{
+    return m_buffer.make_room(window, needed);
+}
+
+
+bool SegmentedOutput::add_reference(DeflateDecompressor::Window& window, const char* data, size_t size)
+{
+    add_owned_piece(window);
+    m_pieces.push_back({ data, 0, size });
+    m_referenced_size += size;
+    return true;
+}
+
+
+bool SegmentedOutput::finish(DeflateDecompressor::Window& window)
+{
+    add_owned_piece(window);
+    if (!m_buffer.finish(window))
+    {
+        return false;
+    }
+
+    m_segments.clear();
+    m_segments.reserve(m_pieces.size());
+    m_size = 0;
+    for (const Piece& piece : m_pieces)
+    {
+        if (piece.input_data)
+        {
+            m_segments.push_back({ piece.input_data, piece.size, true });
+        }
+        else
+        {
+            m_segments.push_back({ m_buffer.data() + piece.offset, piece.size, false });
+        }
+
+        m_size += piece.size;
+    }
+
+    return true;
+}
+
+
+void SegmentedOutput::add_owned_piece(const DeflateDecompressor::Window& window)
+{
+    size_t used = window.next - window.begin;
+    if (used > m_owned_mark)
+    {
+        m_pieces.push_back({ nullptr, m_owned_mark, used - m_owned_mark });
+        m_owned_mark = used;
+    }
+}
+
+
+void SegmentedOutput::copy_to(std::vector<char>& out) const
+{
+    out.clear();
+    out.reserve(m_size);
+    for (const Segment& segment : m_segments)
+    {
+        out.insert(out.end(), segment.data, segment.data + segment.size);
+    }
+}
+
+
+#ifdef SEGMENTED_OUTPUT_HAS_IOVEC
+
+void SegmentedOutput::get_iovecs(std::vector<iovec>& iovecs) const
+{
+    iovecs.clear();
+    iovecs.reserve(m_segments.size());
+    for (const Segment& segment : m_segments)
+    {
+        iovecs.push_back({ const_cast<char*>(segment.data), segment.size });
+    }
+}
+
+
+bool SegmentedOutput::write_to(int fd) const
+{
+    std::vector<iovec> iovecs;
+    get_iovecs(iovecs);
+
+    size_t index = 0;
+    while (index < iovecs.size())
+    {
+        int count = int(std::min<size_t>(iovecs.size() - index, IOV_MAX));
+        ssize_t written = ::writev(fd, &iovecs[index], count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        //  Skip past what got written, and adjust a partially written segment
+        size_t remaining = size_t(written);
+        while (index < iovecs.size() && remaining >= iovecs[index].iov_len)
+        {
+            remaining -= iovecs[index].iov_len;
+            ++index;
+        }
+
+        if (remaining)
+        {
+            iovecs[index].iov_base = static_cast<char*>(iovecs[index].iov_base) + remaining;
+            iovecs[index].iov_len -= remaining;
+        }
+    }
+
+    return true;
+}
+
+#endif
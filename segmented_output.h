@@ -0,0 +1,84 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "output_buffer.h"
+
+#include <vector>
+
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#define SEGMENTED_OUTPUT_HAS_IOVEC
+#endif
+
+//  Output as a list of segments instead of a flat buffer.
+//
+//  Stored (uncompressed) data that later data can't refer back to is
+//  kept as a pointer into the input. Everything else lives in a buffer
+//  owned by this object. A consumer that takes iovecs can then write
+//  the result out without ever copying the stored data.
+//
+//  The segments point into the input, so they are valid only as long
+//  as the input passed to decompress.
+//
+class SegmentedOutput : public DeflateDecompressor::Output
+{
+public:
+    struct Segment
+    {
+        const char* data;
+        size_t size;
+        bool from_input;
+    };
+
+    explicit SegmentedOutput(OutputArena* arena = nullptr);
+
+    //  Available after a successful decompress
+    const std::vector<Segment>& segments() const { return m_segments; }
+
+    //  Total size of all the segments
+    size_t size() const { return m_size; }
+
+    //  Bytes referenced from the input instead of copied
+    size_t referenced_size() const { return m_referenced_size; }
+
+    //  Gather everything into a flat buffer
+    void copy_to(std::vector<char>& out) const;
+
+#ifdef SEGMENTED_OUTPUT_HAS_IOVEC
+    void get_iovecs(std::vector<iovec>& iovecs) const;
+
+    //  Write all the segments with writev. Returns false on errors.
+    bool write_to(int fd) const;
+#endif
+
+    //  The DeflateDecompressor::Output interface
+    bool start(DeflateDecompressor::Window& window, size_t size_hint) override;
+    bool make_room(DeflateDecompressor::Window& window, size_t needed) override;
+    bool finish(DeflateDecompressor::Window& window) override;
+    bool add_reference(DeflateDecompressor::Window& window, const char* data, size_t size) override;
+
+private:
+    //  The owned buffer may move while decompressing, so the
+    //  segments are kept as offsets into it until the end.
+    struct Piece
+    {
+        const char* input_data;   // nullptr for owned data
+        size_t offset;
+        size_t size;
+    };
+
+    void add_owned_piece(const DeflateDecompressor::Window& window);
+
+    OutputBuffer m_buffer;
+    std::vector<Piece> m_pieces;
+    std::vector<Segment> m_segments;
+
+    //  Owned data before this offset is already in the pieces
+    size_t m_owned_mark = 0;
+
+    size_t m_size = 0;
+    size_t m_referenced_size = 0;
+};
@@ -2,13 +2,31 @@
 //    Copyright (C) 2020 Martti Ylioja
 //    SPDX-License-Identifier: GPL-3.0-or-later
 //
+#include <algorithm>
 #include <cctype>
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <thread>
 
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "decompress_pipeline.h"
+#include "deflate_decoder.h"
 #include "deflate_decompressor.h"
+#include "fd_stream.h"
+#include "mapped_file_output.h"
+#include "output_buffer.h"
+#include "perf_counters.h"
+#include "png_unfilter_output.h"
 #include "performance_timer.h"
+#include "segmented_output.h"
+#include "zip_reader.h"
 #include "zlib_interface.h"
 
 namespace {
@@ -16,6 +34,129 @@ namespace {
     constexpr int max_count = 258;
     constexpr int max_distance = 32768;
 
+    //  A minimal ZIP writer for testing the reader
+    struct ZipTestEntry
+    {
+        std::string name;
+        std::vector<char> data;
+        bool deflated;
+    };
+
+
+    void put_le(std::vector<char>& out, uint64_t value, int size)
+    {
+        while (size--)
+        {
+            out.push_back(char(value & 0xff));
+            value >>= 8;
+        }
+    }
+
+
+    //  With zip64, the sizes and offsets are all in the ZIP64 fields and records
+    std::vector<char> build_zip(const std::vector<ZipTestEntry>& entries, bool zip64)
+    {
+        std::vector<char> archive;
+        std::vector<char> directory;
+        uint32_t escape = 0xffffffff;
+
+        for (const ZipTestEntry& entry : entries)
+        {
+            std::vector<char> data;
+            if (entry.deflated)
+            {
+                ZlibInterface::deflate(entry.data, data, ZlibInterface::Raw + ZlibInterface::BestCompression);
+            }
+            else
+            {
+                data = entry.data;
+            }
+
+            uint32_t crc = DeflateDecompressor::crc32(0, entry.data.data(), entry.data.size());
+            uint64_t offset = archive.size();
+
+            put_le(archive, 0x04034b50, 4);
+            put_le(archive, 45, 2);
+            put_le(archive, 0, 2);
+            put_le(archive, entry.deflated ? 8 : 0, 2);
+            put_le(archive, 0, 4);
+            put_le(archive, crc, 4);
+            put_le(archive, zip64 ? escape : data.size(), 4);
+            put_le(archive, zip64 ? escape : entry.data.size(), 4);
+            put_le(archive, entry.name.size(), 2);
+            put_le(archive, zip64 ? 20 : 0, 2);
+            archive.insert(archive.end(), entry.name.begin(), entry.name.end());
+            if (zip64)
+            {
+                put_le(archive, 1, 2);
+                put_le(archive, 16, 2);
+                put_le(archive, entry.data.size(), 8);
+                put_le(archive, data.size(), 8);
+            }
+
+            archive.insert(archive.end(), data.begin(), data.end());
+
+            put_le(directory, 0x02014b50, 4);
+            put_le(directory, 45, 2);
+            put_le(directory, 45, 2);
+            put_le(directory, 0, 2);
+            put_le(directory, entry.deflated ? 8 : 0, 2);
+            put_le(directory, 0, 4);
+            put_le(directory, crc, 4);
+            put_le(directory, zip64 ? escape : data.size(), 4);
+            put_le(directory, zip64 ? escape : entry.data.size(), 4);
+            put_le(directory, entry.name.size(), 2);
+            put_le(directory, zip64 ? 28 : 0, 2);
+            put_le(directory, 0, 2);
+            put_le(directory, 0, 2);
+            put_le(directory, 0, 2);
+            put_le(directory, 0, 4);
+            put_le(directory, zip64 ? escape : offset, 4);
+            directory.insert(directory.end(), entry.name.begin(), entry.name.end());
+            if (zip64)
+            {
+                put_le(directory, 1, 2);
+                put_le(directory, 24, 2);
+                put_le(directory, entry.data.size(), 8);
+                put_le(directory, data.size(), 8);
+                put_le(directory, offset, 8);
+            }
+        }
+
+        uint64_t directory_offset = archive.size();
+        archive.insert(archive.end(), directory.begin(), directory.end());
+
+        if (zip64)
+        {
+            uint64_t record_offset = archive.size();
+            put_le(archive, 0x06064b50, 4);
+            put_le(archive, 44, 8);
+            put_le(archive, 45, 2);
+            put_le(archive, 45, 2);
+            put_le(archive, 0, 4);
+            put_le(archive, 0, 4);
+            put_le(archive, entries.size(), 8);
+            put_le(archive, entries.size(), 8);
+            put_le(archive, directory.size(), 8);
+            put_le(archive, directory_offset, 8);
+
+            put_le(archive, 0x07064b50, 4);
+            put_le(archive, 0, 4);
+            put_le(archive, record_offset, 8);
+            put_le(archive, 1, 4);
+        }
+
+        put_le(archive, 0x06054b50, 4);
+        put_le(archive, 0, 2);
+        put_le(archive, 0, 2);
+        put_le(archive, zip64 ? 0xffff : entries.size(), 2);
+        put_le(archive, zip64 ? 0xffff : entries.size(), 2);
+        put_le(archive, zip64 ? escape : directory.size(), 4);
+        put_le(archive, zip64 ? escape : directory_offset, 4);
+        put_le(archive, 0, 2);
+        return archive;
+    }
+
     class DeflateTester
     {
     public:
@@ -42,7 +183,66 @@ namespace {
             kAllDone,
         };
 
-        bool compare_performance(int input_size);
+        bool compare_performance(int input_size, bool use_counters);
+
+        //  Speed with lots of small blocks, where building the decode tables matters
+        bool compare_small_block_performance(int input_size, int block_size);
+
+        //  Reading the end of a stream, skipping what's before it
+        bool compare_skip_performance(int input_size);
+
+        //  Page faults and TLB misses when the output is backed by huge pages
+        bool compare_huge_page_performance(int input_size, bool use_counters);
+
+        //  Short matches from far back in the window
+        bool compare_far_match_performance(int input_size);
+
+        //  Decompress into pooled and arena backed buffers
+        bool test_output_buffers();
+
+        //  Repeated code lengths should hit the decode table cache
+        bool test_table_cache();
+
+        //  Stored blocks should be referenced from the input, not copied
+        bool test_segmented_output();
+
+        //  Decompress directly into a memory mapped file
+        bool test_mapped_file_output();
+        bool test_fd_stream();
+        bool test_decompress_pipeline();
+        bool test_token_export();
+        bool test_zip_reader();
+
+        //  Input in many small pieces, like the IDAT chunks of a PNG
+        bool test_span_input();
+
+        //  PNG rows with all the filter types, unfiltered while decompressing
+        bool test_png_unfilter();
+
+        //  Streams back to back in one buffer, without knowing their sizes
+        bool test_trailing_data();
+
+        //  Stop decoding after the first few bytes
+        bool test_prefix_decompress();
+
+        //  Checking the data without keeping the output
+        bool test_verify();
+        bool test_decompress_range();
+
+        //  More than 4 GiB of output from a handmade stream
+        bool test_large_stream();
+
+        //  Output sizes asked for up front
+        bool test_size_hints();
+
+        //  Blocks that get a decode loop of their own
+        bool test_block_kinds();
+
+        //  One const decoder shared by several threads
+        bool test_shared_decoder();
+
+        //  Distance codes 30 and 31, which would reach past 32 KiB
+        bool test_far_distance_codes();
 
     private:
         int data_size() const { return int(m_test_data.size()); }
@@ -51,6 +251,12 @@ namespace {
         void decompress_with_own_code();
         void decompress_with_zlib();
 
+        //  Time a single decompress, accumulating the counters if they are open
+        int64_t time_own_code(PerfCounters& counters);
+        int64_t time_zlib(PerfCounters& counters);
+
+        void report_counters(const char* label, const PerfCounters& counters, int runs, int64_t bytes);
+
         //  Return a positive integer less than a limit
         int random_int(int limit);
 
@@ -59,6 +265,9 @@ namespace {
 
         uint32_t xorshift32();
 
+        //  Fill the test data with something that compresses well
+        void text_like_fill(int size);
+
         void begin_test(const char* name);
         bool test_done();
 
@@ -71,259 +280,2224 @@ namespace {
         bool random_repeats_fill();
         bool special_cases_fill();
 
-        int m_max_size;
-        int m_compressed_size = 0;
-        int m_generator = kEmptyInput;
-        int m_generator_state = 0;
-        int m_mode = 0;
+        int m_max_size;
+        int m_compressed_size = 0;
+        int m_generator = kEmptyInput;
+        int m_generator_state = 0;
+        int m_mode = 0;
+
+        const char* m_test_name = "";
+
+        uint32_t m_xorshift32_state = 0x1234567;
+
+        std::vector<char> m_test_data;
+        std::vector<char> m_compressed;
+        std::vector<char> m_decompressed;
+    };
+
+
+    DeflateTester::DeflateTester(int max_size)
+        : m_max_size(max_size)
+    {
+        m_test_data.reserve(max_size);
+        m_compressed.reserve(max_size + max_size/200 + 100);  // About 0.5% extra
+    }
+
+
+    bool DeflateTester::run_all_tests()
+    {
+        DeflateDecompressor deflate;
+
+        m_generator = kEmptyInput;
+        m_test_data.clear();
+
+        while (generate_data())
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            const char* input = m_compressed.data();
+            size_t input_size = m_compressed_size;
+
+            m_decompressed.clear();
+            int err = deflate.decompress(input, input_size, m_decompressed);
+            if (err)
+            {
+                std::cerr << "DeflateDecompressor decompress error code: " << err << "\n";
+                return false;
+            }
+
+            if (m_decompressed != m_test_data)
+            {
+                std::cerr << "Error: Invalid decompress result\n";
+                return false;
+            }
+
+        }
+
+        return true;
+    }
+
+
+    bool DeflateTester::generate_data()
+    {
+        switch (m_generator)
+        {
+        case kEmptyInput:
+            ++m_generator;
+            return true;
+            break;
+
+        case kRandomMix:
+            return random_mix_fill();
+            break;
+
+        case kRandomAlphabet:
+            return random_alphabet_fill();
+            break;
+
+        case kRandomZeroes:
+            return random_zeroes_fill();
+            break;
+
+        case kSimpleFill:
+            return simple_fill();
+            break;
+
+        case kRandomBytes:
+            return random_bytes_fill();
+            break;
+
+        case kRepeatedSequences:
+            return repeated_sequences_fill();
+            break;
+
+        case kRandomRepeats:
+            return random_repeats_fill();
+            break;
+
+        case kSpecialCases:
+            return special_cases_fill();
+            break;
+
+        case kAllDone:
+            break;
+        };
+
+        return false;
+    }
+
+
+    bool DeflateTester::compress()
+    {
+        static const int mode[] = {
+            ZlibInterface::Raw,
+            ZlibInterface::Zlib,
+            ZlibInterface::Gzip,
+        };
+
+        ++m_mode;
+        if (m_mode == sizeof mode / sizeof mode[0])
+        {
+            m_mode = 0;
+        }
+
+        m_compressed_size = 0;
+        m_compressed.clear();
+
+        if (!ZlibInterface::deflate(
+            m_test_data,
+            m_compressed,
+            mode[m_mode] + ZlibInterface::BestCompression))
+        {
+            return false;
+        }
+
+        m_compressed_size = m_compressed.size();
+
+        return true;
+    }
+
+
+    bool DeflateTester::compare_performance(int input_size, bool use_counters)
+    {
+        if (input_size > m_max_size)
+        {
+            input_size = m_max_size;
+        }
+
+        int64_t own_elapsed_time = 0;
+        int64_t zlib_elapsed_time = 0;
+
+        PerfCounters own_counters;
+        PerfCounters zlib_counters;
+        if (use_counters)
+        {
+            own_counters.open();
+            zlib_counters.open();
+            if (!own_counters.any_available())
+            {
+                std::cout << "Performance counters not available, reporting time only\n";
+            }
+        }
+
+        int runs = 0;
+        int64_t total_bytes = 0;
+
+        int loop_count = 200;
+        while (loop_count--)
+        {
+            text_like_fill(input_size);
+
+            //  compress() advances the mode first, so this selects gzip
+            m_mode = 1;
+            compress();
+
+            ++runs;
+            total_bytes += input_size;
+
+            //  Alternate the order to even out any cache effects
+            if (loop_count & 1)
+            {
+                own_elapsed_time += time_own_code(own_counters);
+                zlib_elapsed_time += time_zlib(zlib_counters);
+            }
+            else
+            {
+                zlib_elapsed_time += time_zlib(zlib_counters);
+                own_elapsed_time += time_own_code(own_counters);
+            }
+        }
+
+        std::cout << "Own:  " << std::setw(8) << own_elapsed_time << " microseconds\n";
+        std::cout << "Zlib: " << std::setw(8) << zlib_elapsed_time << " microseconds\n";
+
+        report_counters("Own", own_counters, runs, total_bytes);
+        report_counters("Zlib", zlib_counters, runs, total_bytes);
+
+        return true;
+    }
+
+
+    bool DeflateTester::compare_small_block_performance(int input_size, int block_size)
+    {
+        //  Letters with a skewed distribution, so that every block gets
+        //  dynamic Huffman codes of its own
+        m_test_data.clear();
+        for (int ix = 0; ix < input_size; ++ix)
+        {
+            m_test_data.push_back('a' + (random_bool(50) ? random_int(26) : random_int(4)));
+        }
+
+        m_compressed.clear();
+        if (!ZlibInterface::deflate(m_test_data, m_compressed, ZlibInterface::Zlib + ZlibInterface::BestCompression, block_size))
+        {
+            return false;
+        }
+
+        m_compressed_size = m_compressed.size();
+
+        DeflateDecompressor cached;
+        DeflateDecompressor uncached;
+        cached.set_table_cache_enabled(true);
+
+        int64_t cached_elapsed_time = 0;
+        int64_t uncached_elapsed_time = 0;
+        int64_t zlib_elapsed_time = 0;
+
+        int loop_count = 50;
+        while (loop_count--)
+        {
+            int64_t start_time = PerformanceTimer::get_timestamp();
+            cached.decompress(m_compressed.data(), m_compressed_size, m_decompressed);
+            cached_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+
+            start_time = PerformanceTimer::get_timestamp();
+            uncached.decompress(m_compressed.data(), m_compressed_size, m_decompressed);
+            uncached_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+
+            start_time = PerformanceTimer::get_timestamp();
+            ZlibInterface::inflate(m_compressed.data(), m_compressed_size, m_decompressed);
+            zlib_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+        }
+
+        if (m_decompressed != m_test_data)
+        {
+            std::cerr << "Error: Invalid decompress result with small blocks\n";
+            return false;
+        }
+
+        const DeflateDecompressor::TableCacheStatistics& statistics = cached.table_cache_statistics();
+
+        std::cout << block_size << " byte blocks:\n";
+        std::cout << "Own:          " << std::setw(8) << cached_elapsed_time << " microseconds, "
+            << statistics.hits << " table cache hits, " << statistics.misses << " misses\n";
+        std::cout << "Own no cache: " << std::setw(8) << uncached_elapsed_time << " microseconds\n";
+        std::cout << "Zlib:         " << std::setw(8) << zlib_elapsed_time << " microseconds\n";
+
+        return true;
+    }
+
+
+    bool DeflateTester::compare_skip_performance(int input_size)
+    {
+        text_like_fill(input_size);
+        m_mode = 1;     // gzip
+        if (!compress())
+        {
+            return false;
+        }
+
+        DeflateDecompressor deflate;
+        size_t tail_size = 4096;
+        size_t offset = m_test_data.size() - tail_size;
+        std::vector<char> tail;
+
+        int64_t full_elapsed_time = 0;
+        int64_t skip_elapsed_time = 0;
+
+        int loop_count = 5;
+        while (loop_count--)
+        {
+            int64_t start_time = PerformanceTimer::get_timestamp();
+            deflate.decompress(m_compressed.data(), m_compressed_size, m_decompressed);
+            full_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+
+            start_time = PerformanceTimer::get_timestamp();
+            deflate.decompress_range(m_compressed.data(), m_compressed_size, offset, tail_size, tail);
+            skip_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+        }
+
+        if (!std::equal(tail.begin(), tail.end(), m_test_data.begin() + offset) || tail.size() != tail_size)
+        {
+            std::cerr << "Error: Invalid decompress result after skipping\n";
+            return false;
+        }
+
+        std::cout << "Last " << tail_size << " of " << input_size << " bytes:\n";
+        std::cout << "Everything:   " << std::setw(8) << full_elapsed_time << " microseconds\n";
+        std::cout << "Skipping:     " << std::setw(8) << skip_elapsed_time << " microseconds\n";
+
+        return true;
+    }
+
+
+    bool DeflateTester::compare_huge_page_performance(int input_size, bool use_counters)
+    {
+#ifdef OUTPUT_BUFFER_HAS_HUGE_PAGES
+        text_like_fill(input_size);
+        m_mode = 1;     // gzip, so the output size is known up front
+        if (!compress())
+        {
+            return false;
+        }
+
+        //  Small pages from malloc, huge pages, and huge pages faulted in early
+        HugePageArena huge_pages;
+        HugePageArena populated(8*1024*1024, true);
+        OutputArena* arenas[] = { OutputArena::default_arena(), &huge_pages, &populated };
+        const char* labels[] = { "Small pages", "Huge pages", "Populated" };
+        constexpr int arena_count = 3;
+
+        int64_t elapsed_time[arena_count] = {};
+        long page_faults[arena_count] = {};
+        PerfCounters counters[arena_count];
+        if (use_counters)
+        {
+            for (PerfCounters& arena_counters : counters)
+            {
+                arena_counters.open();
+            }
+        }
+
+        DeflateDecompressor deflate;
+        const int runs = 5;
+        for (int run = 0; run < runs; ++run)
+        {
+            for (int ix = 0; ix < arena_count; ++ix)
+            {
+                //  A new buffer every time, so that all its pages are fresh
+                OutputBuffer buffer(arenas[ix]);
+
+                rusage before;
+                getrusage(RUSAGE_SELF, &before);
+                counters[ix].start();
+                int64_t start_time = PerformanceTimer::get_timestamp();
+
+                int err = deflate.decompress(m_compressed.data(), m_compressed_size, buffer);
+
+                elapsed_time[ix] += PerformanceTimer::get_elapsed_time(start_time);
+                counters[ix].stop();
+                rusage after;
+                getrusage(RUSAGE_SELF, &after);
+                page_faults[ix] += after.ru_minflt - before.ru_minflt;
+
+                if (err || !std::equal(buffer.begin(), buffer.end(), m_test_data.begin(), m_test_data.end()))
+                {
+                    std::cerr << "Error: Invalid decompress result with " << labels[ix] << "\n";
+                    return false;
+                }
+            }
+        }
+
+        std::cout << "Output of " << input_size << " bytes:\n";
+        for (int ix = 0; ix < arena_count; ++ix)
+        {
+            std::cout << std::left << std::setw(14) << labels[ix] << std::right
+                << std::setw(8) << elapsed_time[ix] << " microseconds, "
+                << page_faults[ix] / runs << " page faults per run\n";
+        }
+
+        for (int ix = 0; ix < arena_count; ++ix)
+        {
+            report_counters(labels[ix], counters[ix], runs, int64_t(runs)*input_size);
+        }
+#else
+        (void)input_size;
+        (void)use_counters;
+#endif
+
+        return true;
+    }
+
+
+    bool DeflateTester::compare_far_match_performance(int input_size)
+    {
+        //  Random bytes to start with, and then pieces of 6 to 40 bytes
+        //  copied from 16 to 32 KiB back, each followed by a random byte
+        m_test_data.clear();
+        while (data_size() < 32*1024)
+        {
+            m_test_data.push_back(char(xorshift32()));
+        }
+
+        while (data_size() < input_size)
+        {
+            int distance = 16*1024 + random_int(16*1024);
+            int length = 6 + random_int(34);
+            for (int ix = 0; ix < length; ++ix)
+            {
+                m_test_data.push_back(m_test_data[m_test_data.size() - distance]);
+            }
+
+            m_test_data.push_back(char(xorshift32()));
+        }
+
+        m_test_data.resize(input_size);
+        m_compressed.clear();
+        if (!ZlibInterface::deflate(m_test_data, m_compressed, ZlibInterface::Gzip + 6))
+        {
+            return false;
+        }
+
+        m_compressed_size = m_compressed.size();
+
+        DeflateDecompressor deflate;
+        int64_t own_elapsed_time = 0;
+        int64_t zlib_elapsed_time = 0;
+
+        int loop_count = 5;
+        while (loop_count--)
+        {
+            int64_t start_time = PerformanceTimer::get_timestamp();
+            deflate.decompress(m_compressed.data(), m_compressed_size, m_decompressed);
+            own_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+
+            start_time = PerformanceTimer::get_timestamp();
+            ZlibInterface::inflate(m_compressed.data(), m_compressed_size, m_decompressed);
+            zlib_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+        }
+
+        deflate.decompress(m_compressed.data(), m_compressed_size, m_decompressed);
+        if (m_decompressed != m_test_data)
+        {
+            std::cerr << "Error: Invalid decompress result with far matches\n";
+            return false;
+        }
+
+        std::cout << "Far matches in " << input_size << " bytes:\n";
+        std::cout << "Own:          " << std::setw(8) << own_elapsed_time << " microseconds\n";
+        std::cout << "Zlib:         " << std::setw(8) << zlib_elapsed_time << " microseconds\n";
+
+        return true;
+    }
+
+
+    int64_t DeflateTester::time_own_code(PerfCounters& counters)
+    {
+        counters.start();
+        int64_t start_time = PerformanceTimer::get_timestamp();
+
+        decompress_with_own_code();
+
+        int64_t elapsed = PerformanceTimer::get_elapsed_time(start_time);
+        counters.stop();
+        return elapsed;
+    }
+
+
+    int64_t DeflateTester::time_zlib(PerfCounters& counters)
+    {
+        counters.start();
+        int64_t start_time = PerformanceTimer::get_timestamp();
+
+        decompress_with_zlib();
+
+        int64_t elapsed = PerformanceTimer::get_elapsed_time(start_time);
+        counters.stop();
+        return elapsed;
+    }
+
+
+    void DeflateTester::report_counters(const char* label, const PerfCounters& counters, int runs, int64_t bytes)
+    {
+        if (!counters.any_available() || runs == 0 || bytes == 0)
+        {
+            return;
+        }
+
+        std::cout << label << " counters:\n";
+        for (int ix = 0; ix < PerfCounters::CounterCount; ++ix)
+        {
+            std::cout << "  " << std::left << std::setw(14) << PerfCounters::name(ix) << std::right;
+            if (!counters.available(ix))
+            {
+                std::cout << "   not available\n";
+                continue;
+            }
+
+            uint64_t value = counters.value(ix);
+            std::cout << std::setw(12) << value / runs << " per run "
+                << std::fixed << std::setprecision(4) << std::setw(10)
+                << double(value) / double(bytes) << " per byte\n";
+        }
+    }
+
+
+    bool DeflateTester::test_output_buffers()
+    {
+        std::cout << "Output buffer test\n";
+
+        DeflateDecompressor deflate;
+        BufferPool pool;
+
+        //  Messages of a few different sizes, each in all the formats
+        const int sizes[] = { 100, 5000, 70000 };
+        std::vector<std::vector<char>> inputs;
+        std::vector<std::vector<char>> compressed;
+        for (int size : sizes)
+        {
+            text_like_fill(size);
+            for (int ix = 0; ix < 3; ++ix)
+            {
+                if (!compress())
+                {
+                    return false;
+                }
+
+                inputs.push_back(m_test_data);
+                compressed.push_back(m_compressed);
+            }
+        }
+
+        size_t allocations_after_warmup = 0;
+        for (int round = 0; round < 3; ++round)
+        {
+            for (size_t ix = 0; ix < inputs.size(); ++ix)
+            {
+                OutputBuffer buffer = pool.acquire();
+                int err = deflate.decompress(compressed[ix].data(), compressed[ix].size(), buffer);
+                if (err || !std::equal(buffer.begin(), buffer.end(), inputs[ix].begin(), inputs[ix].end()))
+                {
+                    std::cerr << "Error: Invalid decompress result with a pooled buffer\n";
+                    return false;
+                }
+            }
+
+            if (round == 0)
+            {
+                allocations_after_warmup = pool.system_allocations();
+            }
+        }
+
+        //  Once warmed up, the pool should serve everything
+        if (pool.system_allocations() != allocations_after_warmup)
+        {
+            std::cerr << "Error: Buffer pool allocated after warmup\n";
+            return false;
+        }
+
+#ifdef __cpp_lib_memory_resource
+        char arena_memory[256*1024];
+        std::pmr::monotonic_buffer_resource resource(arena_memory, sizeof arena_memory);
+        PmrArena arena(&resource);
+        OutputBuffer buffer(&arena);
+        for (size_t ix = 0; ix < inputs.size(); ++ix)
+        {
+            int err = deflate.decompress(compressed[ix].data(), compressed[ix].size(), buffer);
+            if (err || !std::equal(buffer.begin(), buffer.end(), inputs[ix].begin(), inputs[ix].end()))
+            {
+                std::cerr << "Error: Invalid decompress result with a pmr buffer\n";
+                return false;
+            }
+        }
+#endif
+
+        std::cout << "Output buffer test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_table_cache()
+    {
+        std::cout << "Table cache test\n";
+
+        DeflateDecompressor deflate;
+        deflate.set_table_cache_enabled(true);
+
+        text_like_fill(200*1024);
+        if (!compress())
+        {
+            return false;
+        }
+
+        //  The second round uses exactly the same codes as the first
+        for (int round = 0; round < 2; ++round)
+        {
+            deflate.reset_table_cache_statistics();
+            int err = deflate.decompress(m_compressed.data(), m_compressed.size(), m_decompressed);
+            if (err || m_decompressed != m_test_data)
+            {
+                std::cerr << "Error: Invalid decompress result with the table cache\n";
+                return false;
+            }
+        }
+
+        DeflateDecompressor::TableCacheStatistics statistics = deflate.table_cache_statistics();
+        if (statistics.hits == 0 || statistics.misses != 0)
+        {
+            std::cerr << "Error: Unexpected table cache statistics "
+                << statistics.hits << " hits, " << statistics.misses << " misses\n";
+            return false;
+        }
+
+        deflate.set_table_cache_enabled(false);
+        int err = deflate.decompress(m_compressed.data(), m_compressed.size(), m_decompressed);
+        if (err || m_decompressed != m_test_data)
+        {
+            std::cerr << "Error: Invalid decompress result without the table cache\n";
+            return false;
+        }
+
+        std::cout << "Table cache test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_segmented_output()
+    {
+        std::cout << "Segmented output test\n";
+
+        //  Incompressible data that zlib stores as is, then data that refers
+        //  back into it, and finally some more stored data to end the stream.
+        m_test_data.clear();
+        for (int ix = 0; ix < 300000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        for (int ix = 0; ix < 100000; ++ix)
+        {
+            m_test_data.push_back(m_test_data[m_test_data.size() - 20000]);
+        }
+
+        for (int ix = 0; ix < 100000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        DeflateDecompressor deflate;
+        SegmentedOutput output;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            int err = deflate.decompress(m_compressed.data(), m_compressed.size(), output);
+            output.copy_to(m_decompressed);
+            if (err || m_decompressed != m_test_data)
+            {
+                std::cerr << "Error: Invalid decompress result with segmented output\n";
+                return false;
+            }
+
+            //  All but the last 32 KiB of the first stored run, and the final run
+            if (output.referenced_size() < 300000 - 32*1024)
+            {
+                std::cerr << "Error: Stored data copied instead of referenced\n";
+                return false;
+            }
+        }
+
+#ifdef SEGMENTED_OUTPUT_HAS_IOVEC
+        std::FILE* file = std::tmpfile();
+        if (!file || !output.write_to(fileno(file)))
+        {
+            std::cerr << "Error: Writing segmented output failed\n";
+            return false;
+        }
+
+        std::rewind(file);
+        std::vector<char> written(output.size() + 1);
+        size_t size = std::fread(written.data(), 1, written.size(), file);
+        std::fclose(file);
+        written.resize(size);
+        if (written != m_test_data)
+        {
+            std::cerr << "Error: Invalid data written from segmented output\n";
+            return false;
+        }
+#endif
+
+        std::cout << "Segmented output test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_mapped_file_output()
+    {
+        std::cout << "Mapped file output test\n";
+
+        char path[] = "/tmp/deflate_test_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+        {
+            std::cerr << "Error: Can't create a temporary file\n";
+            return false;
+        }
+
+        close(fd);
+
+        DeflateDecompressor deflate;
+        text_like_fill(300*1024);
+
+        bool ok = true;
+        for (int ix = 0; ix < 3 && ok; ++ix)
+        {
+            if (!compress())
+            {
+                ok = false;
+                break;
+            }
+
+            //  Only the gzip format tells the size in advance,
+            //  so use a small step to make the others grow the file.
+            MappedFileOutput output;
+            output.set_growth_step(64*1024);
+            int err = output.open(path) ? deflate.decompress(m_compressed.data(), m_compressed.size(), output) : -1;
+            if (!output.close() || err)
+            {
+                std::cerr << "Error: Decompress into a mapped file failed\n";
+                ok = false;
+                break;
+            }
+
+            std::FILE* file = std::fopen(path, "rb");
+            std::vector<char> written(m_test_data.size() + 1);
+            size_t size = file ? std::fread(written.data(), 1, written.size(), file) : 0;
+            if (file)
+            {
+                std::fclose(file);
+            }
+
+            written.resize(size);
+            if (written != m_test_data)
+            {
+                std::cerr << "Error: Invalid data in the mapped output file\n";
+                ok = false;
+            }
+        }
+
+        if (ok && decompress_to_file(deflate, m_compressed.data(), m_compressed.size(), path) != 0)
+        {
+            std::cerr << "Error: decompress_to_file failed\n";
+            ok = false;
+        }
+
+        unlink(path);
+
+        if (ok)
+        {
+            std::cout << "Mapped file output test OK\n";
+        }
+
+        return ok;
+    }
+
+
+    bool DeflateTester::test_fd_stream()
+    {
+        std::cout << "File descriptor stream test\n";
+
+        //  Compressed data mixed with stored blocks
+        text_like_fill(200*1024);
+        for (int ix = 0; ix < 100000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        DeflateDecompressor deflate;
+        std::FILE* out_file = std::tmpfile();
+        if (!out_file)
+        {
+            std::cerr << "Error: Can't create a temporary file\n";
+            return false;
+        }
+
+        bool ok = true;
+        for (int ix = 0; ix < 3 && ok; ++ix)
+        {
+            if (!compress())
+            {
+                ok = false;
+                break;
+            }
+
+            //  Feed the input through a pipe, from another thread
+            int fds[2];
+            if (pipe(fds) != 0)
+            {
+                std::cerr << "Error: Can't create a pipe\n";
+                ok = false;
+                break;
+            }
+
+            std::thread writer([&]()
+            {
+                const char* data = m_compressed.data();
+                size_t size = m_compressed.size();
+                while (size)
+                {
+                    ssize_t count = write(fds[1], data, size);
+                    if (count <= 0)
+                    {
+                        break;
+                    }
+
+                    data += count;
+                    size -= count;
+                }
+
+                close(fds[1]);
+            });
+
+            if (ftruncate(fileno(out_file), 0) != 0 || lseek(fileno(out_file), 0, SEEK_SET) != 0)
+            {
+                ok = false;
+            }
+
+            int err = decompress_fd(deflate, fds[0], fileno(out_file));
+            writer.join();
+            close(fds[0]);
+
+            std::rewind(out_file);
+            std::vector<char> written(m_test_data.size() + 1);
+            written.resize(std::fread(written.data(), 1, written.size(), out_file));
+            if (err || written != m_test_data)
+            {
+                std::cerr << "Error: Invalid decompress result through file descriptors\n";
+                ok = false;
+            }
+
+            //  Tiny chunks split the headers, the bit buffer, and the stored blocks
+            m_test_data.erase(m_test_data.begin() + 3000, m_test_data.end() - 20000);
+            for (size_t chunk_size : { 1, 7, 4096 })
+            {
+                if (!ok || !compress())
+                {
+                    ok = false;
+                    break;
+                }
+
+                std::FILE* in_file = std::tmpfile();
+                if (!in_file)
+                {
+                    ok = false;
+                    break;
+                }
+
+                std::fwrite(m_compressed.data(), 1, m_compressed.size(), in_file);
+                std::fflush(in_file);
+                std::rewind(in_file);
+
+                OutputBuffer output;
+                {
+                    FdInput input(fileno(in_file), chunk_size);
+                    err = deflate.decompress(input, output);
+                }
+
+                std::fclose(in_file);
+                if (err || std::vector<char>(output.data(), output.data() + output.size()) != m_test_data)
+                {
+                    std::cerr << "Error: Invalid decompress result with "
+                        << chunk_size << " byte input chunks\n";
+                    ok = false;
+                }
+            }
+
+            text_like_fill(200*1024);
+            for (int iy = 0; iy < 100000; ++iy)
+            {
+                m_test_data.push_back(xorshift32() & 0xff);
+            }
+        }
+
+        std::fclose(out_file);
+
+        //  Stopping early, with the reader waiting on a pipe that stays open
+        int fds[2];
+        if (ok && pipe(fds) == 0)
+        {
+            //  The reader has a byte, and waits for the rest of its buffer.
+            //  Destroying the input must not wait for it.
+            {
+                FdInput input(fds[0]);
+                ok = (write(fds[1], "x", 1) == 1);
+            }
+
+            close(fds[0]);
+            close(fds[1]);
+        }
+
+        if (ok)
+        {
+            std::cout << "File descriptor stream test OK\n";
+        }
+
+        return ok;
+    }
+
+
+    bool DeflateTester::test_decompress_pipeline()
+    {
+        std::cout << "Decompress pipeline test\n";
+
+        constexpr int file_count = 12;
+        std::vector<std::vector<char>> originals;
+        std::vector<DecompressPipeline::Job> jobs(file_count);
+        bool ok = true;
+
+        for (int ix = 0; ix < file_count && ok; ++ix)
+        {
+            text_like_fill(50*1024 + random_int(400*1024));
+            originals.push_back(m_test_data);
+
+            char in_path[] = "/tmp/deflate_test_XXXXXX";
+            char out_path[] = "/tmp/deflate_test_XXXXXX";
+            int in_fd = mkstemp(in_path);
+            int out_fd = mkstemp(out_path);
+            ok = in_fd >= 0 && out_fd >= 0 && compress()
+                && write(in_fd, m_compressed.data(), m_compressed.size()) == ssize_t(m_compressed.size());
+
+            jobs[ix].input_path = in_path;
+            jobs[ix].output_path = out_path;
+            close(in_fd);
+            close(out_fd);
+        }
+
+        for (bool use_io_uring : { true, false })
+        {
+            //  Small pieces of I/O, so that every file takes several
+            DecompressPipeline::Options options;
+            options.use_io_uring = use_io_uring;
+            options.io_size = 64*1024;
+
+            DecompressPipeline pipeline(options);
+            if (!ok || !pipeline.run(jobs))
+            {
+                std::cerr << "Error: Decompress pipeline failed\n";
+                ok = false;
+                break;
+            }
+
+            for (int ix = 0; ix < file_count && ok; ++ix)
+            {
+                std::FILE* file = std::fopen(jobs[ix].output_path.c_str(), "rb");
+                std::vector<char> written(originals[ix].size() + 1);
+                written.resize(file ? std::fread(written.data(), 1, written.size(), file) : 0);
+                if (file)
+                {
+                    std::fclose(file);
+                }
+
+                if (jobs[ix].result != 0 || written != originals[ix])
+                {
+                    std::cerr << "Error: Invalid data from the decompress pipeline\n";
+                    ok = false;
+                }
+            }
+
+            const DecompressPipeline::Statistics& statistics = pipeline.statistics();
+            std::cout << (statistics.used_io_uring ? "io_uring: " : "threads:  ")
+                << statistics.input_bytes << " bytes in, "
+                << statistics.output_bytes << " bytes out, "
+                << std::fixed << std::setprecision(2)
+                << statistics.output_gb_per_second() << " GB/s\n";
+        }
+
+        //  A missing input fails only its own job
+        if (ok)
+        {
+            std::vector<DecompressPipeline::Job> bad_jobs(2);
+            bad_jobs[0] = jobs[0];
+            bad_jobs[1].input_path = "/nonexistent/input.gz";
+            bad_jobs[1].output_path = jobs[1].output_path;
+            DecompressPipeline pipeline;
+            if (pipeline.run(bad_jobs) || bad_jobs[0].result != 0 || bad_jobs[1].result == 0)
+            {
+                std::cerr << "Error: Unexpected results with a missing input file\n";
+                ok = false;
+            }
+        }
+
+        for (const DecompressPipeline::Job& job : jobs)
+        {
+            unlink(job.input_path.c_str());
+            unlink(job.output_path.c_str());
+        }
+
+        if (ok)
+        {
+            std::cout << "Decompress pipeline test OK\n";
+        }
+
+        return ok;
+    }
+
+
+    //  Rebuilds the data from the tokens, and keeps some statistics
+    class TokenRebuilder : public DeflateDecompressor::TokenConsumer
+    {
+    public:
+        bool consume(const DeflateDecompressor::TokenBatch& batch) override
+        {
+            for (const DeflateDecompressor::Token& token : batch)
+            {
+                switch (token.kind)
+                {
+                case DeflateDecompressor::Token::Literals:
+                    data.insert(data.end(), token.data, token.data + token.size);
+                    break;
+
+                case DeflateDecompressor::Token::Match:
+                    ++matches;
+                    for (uint32_t ix = 0; ix < token.size; ++ix)
+                    {
+                        data.push_back(data[data.size() - token.distance]);
+                    }
+                    break;
+
+                case DeflateDecompressor::Token::Block:
+                    ++blocks;
+                    final_blocks += token.final_block;
+                    if (token.block_type == 2 && token.size != uint32_t(token.literal_codes + token.distance_codes))
+                    {
+                        return false;
+                    }
+                    break;
+                }
+            }
+
+            ++batches;
+            return batches <= batch_limit;
+        }
+
+        std::vector<char> data;
+        int batches = 0;
+        int batch_limit = INT_MAX;
+        int blocks = 0;
+        int final_blocks = 0;
+        int matches = 0;
+    };
+
+
+    bool DeflateTester::test_token_export()
+    {
+        std::cout << "Token export test\n";
+
+        //  Enough matches for several batches, and some stored blocks
+        text_like_fill(2*1024*1024);
+        for (int ix = 0; ix < 100000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        DeflateDecompressor deflate;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            TokenRebuilder rebuilder;
+            int err = deflate.tokenize(m_compressed.data(), m_compressed.size(), rebuilder);
+            if (err || rebuilder.data != m_test_data || rebuilder.final_blocks != 1 || rebuilder.batches < 2)
+            {
+                std::cerr << "Error: Invalid tokens from tokenize\n";
+                return false;
+            }
+
+            TokenRebuilder stopper;
+            stopper.batch_limit = 0;
+            if (deflate.tokenize(m_compressed.data(), m_compressed.size(), stopper) != DeflateDecompressor::eOutputError
+                || stopper.batches != 1)
+            {
+                std::cerr << "Error: The token consumer couldn't stop decoding\n";
+                return false;
+            }
+
+            if (ix == 0)
+            {
+                std::cout << rebuilder.blocks << " blocks, " << rebuilder.matches << " matches in "
+                    << rebuilder.batches << " batches\n";
+            }
+        }
+
+        std::cout << "Token export test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_zip_reader()
+    {
+        std::cout << "ZIP reader test\n";
+
+        std::vector<ZipTestEntry> entries;
+        text_like_fill(100*1024);
+        entries.push_back({ "a.txt", m_test_data, true });
+        entries.push_back({ "dir/", {}, false });
+        entries.push_back({ "dir/empty.txt", {}, true });
+
+        m_test_data.clear();
+        for (int ix = 0; ix < 50000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        entries.push_back({ "dir/stored.bin", m_test_data, false });
+
+        text_like_fill(700*1024);
+        entries.push_back({ "dir/sub/big.txt", m_test_data, true });
+
+        //  A second entry with the same name, as in an appended archive
+        text_like_fill(300*1024);
+        entries.push_back({ "a.txt", m_test_data, true });
+
+        char path[] = "/tmp/deflate_test_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+        {
+            std::cerr << "Error: Can't create a temporary file\n";
+            return false;
+        }
+
+        close(fd);
+        std::string directory = std::string(path) + "_dir";
+
+        bool ok = true;
+        for (bool zip64 : { false, true })
+        {
+            std::vector<char> archive = build_zip(entries, zip64);
+            std::FILE* file = std::fopen(path, "wb");
+            ok = file && std::fwrite(archive.data(), 1, archive.size(), file) == archive.size();
+            if (file)
+            {
+                std::fclose(file);
+            }
+
+            ZipReader zip;
+            if (!ok || !zip.open(path) || zip.entries().size() != entries.size())
+            {
+                std::cerr << "Error: Can't read the ZIP archive: " << (zip.error_message() ? zip.error_message() : "") << '\n';
+                ok = false;
+                break;
+            }
+
+            //  A single entry by name
+            std::vector<char> data;
+            if (zip.extract("dir/sub/big.txt", data) != 0 || data != entries[4].data
+                || zip.extract("nonexistent", data) == 0)
+            {
+                std::cerr << "Error: Invalid ZIP entry extracted by name\n";
+                ok = false;
+                break;
+            }
+
+            if (!zip.extract_all(directory, 3))
+            {
+                std::cerr << "Error: Extracting the ZIP archive failed: " << zip.error_message() << '\n';
+                ok = false;
+                break;
+            }
+
+            for (const ZipTestEntry& entry : entries)
+            {
+                //  Only the first of duplicate names gets extracted
+                std::string entry_path = directory + '/' + entry.name;
+                bool duplicate = false;
+                for (const ZipTestEntry* other = entries.data(); other != &entry; ++other)
+                {
+                    duplicate |= (other->name == entry.name);
+                }
+
+                if (entry.name.back() == '/' || duplicate)
+                {
+                    continue;
+                }
+
+                file = std::fopen(entry_path.c_str(), "rb");
+                std::vector<char> written(entry.data.size() + 1);
+                written.resize(file ? std::fread(written.data(), 1, written.size(), file) : 0);
+                if (file)
+                {
+                    std::fclose(file);
+                }
+
+                unlink(entry_path.c_str());
+                if (!file || written != entry.data)
+                {
+                    std::cerr << "Error: Invalid data in an extracted ZIP entry " << entry.name << '\n';
+                    ok = false;
+                }
+            }
+
+            rmdir((directory + "/dir/sub").c_str());
+            rmdir((directory + "/dir").c_str());
+            rmdir(directory.c_str());
+
+            //  A wrong CRC-32 in the directory gets noticed
+            ZipReader::Entry entry = *zip.find("a.txt");
+            entry.crc32 ^= 1;
+            if (ok && zip.extract(entry, data, DeflateDecompressor::thread_instance()) != DeflateDecompressor::eChecksum)
+            {
+                std::cerr << "Error: ZIP entry CRC-32 mismatch not detected\n";
+                ok = false;
+            }
+        }
+
+        unlink(path);
+
+        if (ok)
+        {
+            std::cout << "ZIP reader test OK\n";
+        }
+
+        return ok;
+    }
+
+
+    void DeflateTester::decompress_with_own_code()
+    {
+        const char* input = m_compressed.data();
+        size_t input_size = m_compressed_size;
+
+        deflate_decompress(input, input_size, m_decompressed);
+    }
+
+
+    void DeflateTester::decompress_with_zlib()
+    {
+        const char* input = m_compressed.data();
+        size_t input_size = m_compressed_size;
+
+        ZlibInterface::inflate(input, input_size, m_decompressed);
+    }
+
+
+    int DeflateTester::random_int(int limit)
+    {
+        int result = int(xorshift32() % limit);
+        return result;
+    }
+
+
+    int DeflateTester::random_bool(int percent)
+    {
+        if (percent < 1)
+        {
+            return false;
+        }
+
+        if (percent >= 100)
+        {
+            return true;
+        }
+
+        constexpr uint32_t one_percent = 0xffffffff / 100;
+        uint32_t limit = percent * one_percent;
+        return  xorshift32() < limit;
+    }
+
+
+    uint32_t DeflateTester::xorshift32()
+    {
+        // Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs"
+        uint32_t x = m_xorshift32_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        m_xorshift32_state = x;
+        return x;
+    }
+
+    void DeflateTester::text_like_fill(int size)
+    {
+        m_test_data.clear();
+        while (size--)
+        {
+            m_test_data.push_back(' ' + (random_bool(30) ? random_int(5) : 0));
+        }
+    }
+
+
+    void DeflateTester::begin_test(const char* name)
+    {
+        if (m_test_data.empty())
+        {
+            m_test_name = name;
+            std::cout << name << '\n';
+        }
+    }
+
+
+    bool DeflateTester::test_span_input()
+    {
+        std::cout << "Span input test\n";
+
+        //  Text with a stretch of incompressible data that gets stored
+        text_like_fill(200*1024);
+        for (int ix = 0; ix < 200*1024; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        DeflateDecompressor deflate;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            //  Pieces of all sizes, including empty ones
+            std::vector<DeflateDecompressor::Span> spans;
+            size_t offset = 0;
+            while (offset < m_compressed.size())
+            {
+                size_t size = random_bool(10) ? random_int(2) : random_int(8192);
+                size = std::min(size, m_compressed.size() - offset);
+                spans.push_back({ m_compressed.data() + offset, size });
+                offset += size;
+            }
+
+            int err = deflate.decompress(spans.data(), spans.size(), m_decompressed);
+            if (err || m_decompressed != m_test_data)
+            {
+                std::cerr << "Error: Invalid decompress result from spans\n";
+                return false;
+            }
+
+            //  Stored blocks inside a single piece are still referenced
+            size_t third = m_compressed.size()/3;
+            DeflateDecompressor::Span thirds[] = {
+                { m_compressed.data(), third },
+                { m_compressed.data() + third, third },
+                { m_compressed.data() + 2*third, m_compressed.size() - 2*third },
+            };
+
+            SegmentedOutput output;
+            err = deflate.decompress(thirds, 3, output);
+            output.copy_to(m_decompressed);
+            if (err || m_decompressed != m_test_data || output.referenced_size() == 0)
+            {
+                std::cerr << "Error: Invalid segmented output from spans\n";
+                return false;
+            }
+
+            //  A missing last piece must be noticed
+            while (spans.back().size == 0)
+            {
+                spans.pop_back();
+            }
+
+            spans.pop_back();
+            if (deflate.decompress(spans.data(), spans.size(), m_decompressed) == 0)
+            {
+                std::cerr << "Error: Truncated span input not detected\n";
+                return false;
+            }
+        }
+
+        std::cout << "Span input test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_png_unfilter()
+    {
+        std::cout << "PNG unfilter test\n";
+
+        DeflateDecompressor deflate;
+        for (int bpp : { 1, 2, 3, 4, 6, 8 })
+        {
+            size_t row_size = bpp*(1 + random_int(3000));
+            size_t row_count = 100;
+
+            //  Smooth gradients with some noise, like a scanned page
+            std::vector<char> pixels(row_size*row_count);
+            for (size_t ix = 0; ix < pixels.size(); ++ix)
+            {
+                pixels[ix] = char(ix/bpp % row_size/16 + ix/row_size + (xorshift32() & 7));
+            }
+
+            //  Filter each row with a random filter type
+            m_test_data.clear();
+            for (size_t row = 0; row < row_count; ++row)
+            {
+                int type = random_int(5);
+                m_test_data.push_back(char(type));
+                const uint8_t* x = reinterpret_cast<const uint8_t*>(&pixels[row*row_size]);
+                for (size_t ix = 0; ix < row_size; ++ix)
+                {
+                    int a = (ix >= size_t(bpp)) ? x[ix - bpp] : 0;
+                    int b = row ? x[ix - row_size] : 0;
+                    int c = (row && ix >= size_t(bpp)) ? x[ix - row_size - bpp] : 0;
+                    int predictor = 0;
+                    switch (type)
+                    {
+                    case 1: predictor = a; break;
+                    case 2: predictor = b; break;
+                    case 3: predictor = (a + b)/2; break;
+                    case 4:
+                        {
+                            int pa = std::abs(b - c);
+                            int pb = std::abs(a - c);
+                            int pc = std::abs(a + b - 2*c);
+                            predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                        }
+                        break;
+                    }
+
+                    m_test_data.push_back(char(x[ix] - predictor));
+                }
+            }
+
+            if (!compress())
+            {
+                return false;
+            }
+
+            //  Rows further apart than their size
+            size_t stride = row_size + 13;
+            std::vector<char> image(stride*row_count);
+            PngUnfilterOutput output(image.data(), stride, row_size, bpp, row_count);
+            int err = deflate.decompress(m_compressed.data(), m_compressed.size(), output);
+            bool ok = (err == 0 && output.rows_done() == row_count);
+            for (size_t row = 0; row < row_count && ok; ++row)
+            {
+                ok = std::equal(&pixels[row*row_size], &pixels[row*row_size] + row_size, &image[row*stride]);
+            }
+
+            if (!ok)
+            {
+                std::cerr << "Error: Invalid PNG unfilter result with " << bpp << " bytes per pixel\n";
+                return false;
+            }
+        }
+
+        //  An invalid filter type, and then a missing row
+        m_test_data[0] = 5;
+        compress();
+        std::vector<char> image(m_test_data.size());
+        PngUnfilterOutput output(image.data(), m_test_data.size(), m_test_data.size(), 1, 1);
+        if (deflate.decompress(m_compressed.data(), m_compressed.size(), output) == 0 || !output.failed())
+        {
+            std::cerr << "Error: Invalid PNG filter type not detected\n";
+            return false;
+        }
+
+        m_test_data.resize(100);
+        m_test_data[0] = 0;
+        compress();
+        PngUnfilterOutput short_output(image.data(), 99, 99, 1, 2);
+        if (deflate.decompress(m_compressed.data(), m_compressed.size(), short_output) == 0
+            || short_output.rows_done() != 1)
+        {
+            std::cerr << "Error: Missing PNG rows not detected\n";
+            return false;
+        }
+
+        std::cout << "PNG unfilter test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_trailing_data()
+    {
+        std::cout << "Trailing data test\n";
+
+        //  One stream in each format, and some junk at the end
+        std::vector<std::vector<char>> originals;
+        std::vector<size_t> sizes;
+        std::vector<char> buffer;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            text_like_fill(1000 + random_int(100000));
+            if (!compress())
+            {
+                return false;
+            }
+
+            originals.push_back(m_test_data);
+            sizes.push_back(m_compressed.size());
+            buffer.insert(buffer.end(), m_compressed.begin(), m_compressed.end());
+        }
+
+        buffer.insert(buffer.end(), 1000, 'x');
+
+        DeflateDecompressor deflate;
+        deflate.set_trailing_data_allowed(true);
+        for (bool use_spans : { false, true })
+        {
+            size_t offset = 0;
+            for (size_t ix = 0; ix < originals.size(); ++ix)
+            {
+                int err = 0;
+                if (use_spans)
+                {
+                    std::vector<DeflateDecompressor::Span> spans;
+                    for (size_t pos = offset; pos < buffer.size(); pos += 999)
+                    {
+                        spans.push_back({ buffer.data() + pos, std::min<size_t>(999, buffer.size() - pos) });
+                    }
+
+                    err = deflate.decompress(spans.data(), spans.size(), m_decompressed);
+                }
+                else
+                {
+                    err = deflate.decompress(buffer.data() + offset, buffer.size() - offset, m_decompressed);
+                }
+
+                if (err || m_decompressed != originals[ix] || deflate.input_consumed() != sizes[ix])
+                {
+                    std::cerr << "Error: Invalid result for stream " << ix << " with trailing data\n";
+                    return false;
+                }
+
+                offset += deflate.input_consumed();
+            }
+        }
+
+        //  The default is to insist on nothing after a wrapped stream.
+        //  A raw stream has no definite end, so only two get rejected.
+        deflate.set_trailing_data_allowed(false);
+        size_t offset = 0;
+        int rejected = 0;
+        for (size_t size : sizes)
+        {
+            if (deflate.decompress(buffer.data() + offset, buffer.size() - offset, m_decompressed) != 0)
+            {
+                ++rejected;
+            }
+
+            offset += size;
+        }
+
+        if (rejected != 2)
+        {
+            std::cerr << "Error: Trailing data not detected\n";
+            return false;
+        }
+
+        std::cout << "Trailing data test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_prefix_decompress()
+    {
+        std::cout << "Prefix decompress test\n";
+
+        text_like_fill(1000000);
+        size_t size = m_test_data.size();
+
+        DeflateDecompressor deflate;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            //  Prefixes as long as the data or longer decode all of it
+            for (size_t max_output : { size, size + 1 })
+            {
+                int err = deflate.decompress_prefix(m_compressed.data(), m_compressed.size(), max_output, m_decompressed);
+                if (err || deflate.output_truncated() || m_decompressed != m_test_data)
+                {
+                    std::cerr << "Error: Invalid result for a prefix longer than the data\n";
+                    return false;
+                }
+            }
+
+            //  Damage the end, which shorter prefixes never get to
+            m_compressed.back() ^= 1;
+            for (size_t max_output : { size_t(0), size_t(1), size_t(4096), size_t(100000), size/2 })
+            {
+                int err = deflate.decompress_prefix(m_compressed.data(), m_compressed.size(), max_output, m_decompressed);
+                if (err || !deflate.output_truncated() || m_decompressed.size() != max_output
+                    || !std::equal(m_decompressed.begin(), m_decompressed.end(), m_test_data.begin()))
+                {
+                    std::cerr << "Error: Invalid prefix of " << max_output << " bytes\n";
+                    return false;
+                }
+            }
+        }
+
+        //  Nothing gets cut off an empty stream, not even with no room at all
+        m_test_data.clear();
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            int err = deflate.decompress_prefix(m_compressed.data(), m_compressed.size(), 0, m_decompressed);
+            if (err || deflate.output_truncated() || !m_decompressed.empty())
+            {
+                std::cerr << "Error: Empty stream truncated by an empty prefix\n";
+                return false;
+            }
+        }
+
+        std::cout << "Prefix decompress test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_verify()
+    {
+        std::cout << "Verify test\n";
+
+        //  Compressed and stored data, more than the window holds
+        text_like_fill(500000);
+        for (int ix = 0; ix < 200000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        DeflateDecompressor deflate;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            //  Intact, then with the trailer damaged, then with the data damaged
+            for (size_t damage : { size_t(0), size_t(1), m_compressed.size()/2 })
+            {
+                std::vector<char> input = m_compressed;
+                if (damage)
+                {
+                    input[input.size() - damage] ^= 0x10;
+                }
+
+                int expected = deflate.decompress(input.data(), input.size(), m_decompressed);
+                int err = deflate.verify(input.data(), input.size());
+                if (err != expected || (damage == 0 && err != 0))
+                {
+                    std::cerr << "Error: verify returned " << err << " instead of " << expected << "\n";
+                    return false;
+                }
+            }
+        }
+
+        std::cout << "Verify test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_decompress_range()
+    {
+        std::cout << "Decompress range test\n";
+
+        text_like_fill(1000000);
+        for (int ix = 0; ix < 100000; ++ix)
+        {
+            m_test_data.push_back(xorshift32() & 0xff);
+        }
+
+        size_t size = m_test_data.size();
+        size_t all = ~size_t(0);
+        struct Range
+        {
+            uint64_t offset;
+            size_t max_output;
+        };
+
+        const Range ranges[] = {
+            { 0, all }, { 0, 10 }, { 1, 100 }, { 32768, 1 }, { 200000, all }, { size/2, 5000 },
+            { size - 10, 100 }, { size - 10, 10 }, { size, 10 }, { size + 5, all }, { 500000, 0 },
+        };
+
+        DeflateDecompressor deflate;
+        std::vector<char> out;
+        for (int ix = 0; ix < 3; ++ix)
+        {
+            if (!compress())
+            {
+                return false;
+            }
+
+            for (const Range& range : ranges)
+            {
+                size_t begin = size_t(std::min<uint64_t>(range.offset, size));
+                size_t end = begin + std::min(range.max_output, size - begin);
+                int err = deflate.decompress_range(m_compressed.data(), m_compressed.size(), range.offset, range.max_output, out);
+                if (err || out.size() != end - begin || !std::equal(out.begin(), out.end(), m_test_data.begin() + begin))
+                {
+                    std::cerr << "Error: Invalid data at " << range.offset << ", " << range.max_output << " bytes\n";
+                    return false;
+                }
+            }
+        }
+
+        std::cout << "Decompress range test OK\n";
+        return true;
+    }
+
+
+    bool DeflateTester::test_large_stream()
+    {
+        std::cout << "Large stream test\n";
+
+        //  Static Huffman blocks of zeroes: a literal zero to start with, and then
+        //  matches of length 258 at distance one. The literal takes eight bits,
+        //  a match thirteen, and the block header and end ten in total. With six
+        //  more matches than a multiple of eight, a block fills whole bytes.
+        struct BitWriter
+        {
+            std::vector<char> bytes;
+            uint32_t bits = 0;
+            int count = 0;
+
+            //  Huffman codes go most significant bit first
+            void put_code(uint32_t code, int length)
+            {
+                while (length--)
+                {
+                    bits |= ((code >> length) & 1) << count;
+                    if (++count == 8)
+                    {
+                        bytes.push_back(char(bits));
+                        bits = 0;
+                        count = 0;
+                    }
+                }
+            }
+
+            void put_block(bool first, int match_count)
+            {
+                put_code(0x2, 3);           // not final, static Huffman, low bit first
+                if (first)
+                {
+                    put_code(0x30, 8);      // literal zero
+                }
+
+                while (match_count--)
+                {
+                    put_code(0xc5, 8);      // length 258
+                    put_code(0, 5);         // distance 1
+                }
+
+                put_code(0, 7);             // end of block
+            }
+        };
+
+        const int match_count = 8*2000 + 6;
+        BitWriter first;
+        first.put_block(true, match_count);
+        BitWriter block;
+        block.put_block(false, match_count);
+        if (first.count || block.count)
+        {
+            std::cerr << "Error: Handmade blocks don't end on a byte boundary\n";
+            return false;
+        }
+
+        //  Enough blocks for a bit over 4 GiB
+        uint64_t block_output = 258*uint64_t(match_count);
+        uint64_t block_count = ((uint64_t(1) << 32) + 100000000)/block_output;
+        uint64_t size = 1 + block_output*(block_count + 1);
+
+        std::vector<char> body = first.bytes;
+        for (uint64_t ix = 0; ix < block_count; ++ix)
+        {
+            body.insert(body.end(), block.bytes.begin(), block.bytes.end());
+        }
+
+        //  An empty final static block
+        body.push_back(3);
+        body.push_back(0);
 
-        const char* m_test_name = "";
+        //  In zlib format. The Adler-32 of zeroes is easy to compute.
+        std::vector<char> input = { 0x78, 0x01 };
+        input.insert(input.end(), body.begin(), body.end());
+        uint32_t adler = uint32_t(size % 65521) << 16 | 1;
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            input.push_back(char(adler >> shift));
+        }
 
-        uint32_t m_xorshift32_state = 0x1234567;
+        DeflateDecompressor deflate;
+        int err = deflate.verify(input.data(), input.size());
+        if (err)
+        {
+            std::cerr << "Error: Verifying " << size << " bytes of output failed: " << deflate.error_message() << "\n";
+            return false;
+        }
 
-        std::vector<char> m_test_data;
-        std::vector<char> m_compressed;
-        std::vector<char> m_decompressed;
-    };
+        //  In gzip format, with the size modulo 2^32 in the trailer. Reading only the
+        //  last bytes leaves out the checksum, so it can be anything.
+        input = { 31, char(139), 8, 0, 0, 0, 0, 0, 0, char(255) };
+        input.insert(input.end(), body.begin(), body.end());
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            input.push_back(char(shift < 32 ? 0 : size >> (shift - 32)));
+        }
 
+        std::vector<char> tail;
+        err = deflate.decompress_range(input.data(), input.size(), size - 10, 100, tail);
+        if (err || tail != std::vector<char>(10, 0))
+        {
+            std::cerr << "Error: Reading the end of " << size << " bytes failed\n";
+            return false;
+        }
 
-    DeflateTester::DeflateTester(int max_size)
-        : m_max_size(max_size)
-    {
-        m_test_data.reserve(max_size);
-        m_compressed.reserve(max_size + max_size/200 + 100);  // About 0.5% extra
+        //  A wrong gzip size must still be noticed
+        input[input.size() - 1] ^= 1;
+        if (deflate.decompress_range(input.data(), input.size(), size - 10, 100, tail) != DeflateDecompressor::eChecksum)
+        {
+            std::cerr << "Error: Invalid gzip size not detected\n";
+            return false;
+        }
+
+        std::cout << "Large stream test OK\n";
+        return true;
     }
 
 
-    bool DeflateTester::run_all_tests()
+    bool DeflateTester::test_size_hints()
     {
-        DeflateDecompressor deflate;
+        std::cout << "Size hint test\n";
 
-        m_generator = kEmptyInput;
-        m_test_data.clear();
+        //  Remembers the size hint it got
+        class HintedBuffer : public OutputBuffer
+        {
+        public:
+            bool start(DeflateDecompressor::Window& window, size_t size_hint) override
+            {
+                m_size_hint = size_hint;
+                return OutputBuffer::start(window, size_hint);
+            }
 
-        while (generate_data())
+            size_t m_size_hint = 0;
+        };
+
+        DeflateDecompressor deflate;
+        HintedBuffer buffer;
+        text_like_fill(1000000);
+        size_t size = m_test_data.size();
+        for (int ix = 0; ix < 3; ++ix)
         {
             if (!compress())
             {
                 return false;
             }
 
-            const char* input = m_compressed.data();
-            size_t input_size = m_compressed_size;
-
-            m_decompressed.clear();
-            int err = deflate.decompress(input, input_size, m_decompressed);
-            if (err)
+            bool gzip = (m_compressed[0] == 31 && m_compressed[1] == char(139));
+            int err = 0;
+            for (int round = 0; round < 4 && !err; ++round)
             {
-                std::cerr << "DeflateDecompressor decompress error code: " << err << "\n";
-                return false;
+                err = deflate.decompress(m_compressed.data(), m_compressed.size(), buffer);
             }
 
-            if (m_decompressed != m_test_data)
+            //  After a few rounds, the estimate should be close
+            size_t hint = buffer.m_size_hint;
+            if (err || (gzip && hint != size) || hint < size*3/4 || hint > size*5/4)
             {
-                std::cerr << "Error: Invalid decompress result\n";
+                std::cerr << "Error: Size hint " << hint << " for " << size << " bytes\n";
                 return false;
             }
+        }
+
+        //  A gzip size beyond the limit isn't trusted
+        DeflateDecompressor::SizeHintPolicy policy;
+        policy.max_trusted_gzip_size = 64*1024;
+        deflate.set_size_hint_policy(policy);
+        m_mode = 1;     // gzip
+        compress();
+        int err = deflate.decompress(m_compressed.data(), m_compressed.size(), buffer);
+        if (err || buffer.m_size_hint != policy.max_trusted_gzip_size)
+        {
+            std::cerr << "Error: Gzip size hint not limited\n";
+            return false;
+        }
+
+        //  An empty stream that claims to be huge
+        const char fake[] = {
+            31, char(139), 8, 0, 0, 0, 0, 0, 0, char(255),
+            3, 0, 0, 0, 0, 0, char(0xf0), char(0xff), char(0xff), char(0xff),
+        };
 
+        deflate.decompress(fake, sizeof fake, buffer);
+        if (buffer.m_size_hint > policy.min_estimate)
+        {
+            std::cerr << "Error: Size hint " << buffer.m_size_hint << " from a fake gzip size\n";
+            return false;
         }
 
+        std::cout << "Size hint test OK\n";
         return true;
     }
 
 
-    bool DeflateTester::generate_data()
+    bool DeflateTester::test_block_kinds()
     {
-        switch (m_generator)
-        {
-        case kEmptyInput:
-            ++m_generator;
-            return true;
-            break;
-
-        case kRandomMix:
-            return random_mix_fill();
-            break;
-
-        case kRandomAlphabet:
-            return random_alphabet_fill();
-            break;
+        std::cout << "Block kind test\n";
 
-        case kRandomZeroes:
-            return random_zeroes_fill();
-            break;
+        DeflateDecompressor deflate;
+        std::vector<char> output;
 
-        case kSimpleFill:
-            return simple_fill();
-            break;
+        //  Literals only, and matches with distances of one or two
+        text_like_fill(300000);
+        const int strategies[] = { ZlibInterface::HuffmanOnly, ZlibInterface::RunLengths };
+        const int modes[] = { ZlibInterface::Zlib, ZlibInterface::Gzip, ZlibInterface::Raw };
+        for (int strategy : strategies)
+        {
+            for (int mode : modes)
+            {
+                m_compressed.clear();
+                if (!ZlibInterface::deflate(m_test_data, m_compressed, mode + strategy + ZlibInterface::BestCompression, 50000))
+                {
+                    return false;
+                }
 
-        case kRandomBytes:
-            return random_bytes_fill();
-            break;
+                int err = deflate.decompress(m_compressed.data(), m_compressed.size(), output);
+                if (err || output != m_test_data)
+                {
+                    std::cerr << "Error: Invalid decompress result with strategy " << strategy << "\n";
+                    return false;
+                }
+            }
+        }
 
-        case kRepeatedSequences:
-            return repeated_sequences_fill();
-            break;
+        //  zlib always gives at least two distance codes. A block with just
+        //  the one for distance 1 has to be made by hand. Its literal/length
+        //  code has 'a', end of block, and lengths 3 and 258, all two bits.
+        struct BitWriter
+        {
+            std::vector<char> bytes;
+            uint32_t bits = 0;
+            int count = 0;
 
-        case kRandomRepeats:
-            return random_repeats_fill();
-            break;
+            //  Header fields and extra bits go least significant bit first
+            void put_bits(uint32_t value, int length)
+            {
+                for (int ix = 0; ix < length; ++ix)
+                {
+                    bits |= ((value >> ix) & 1) << count;
+                    if (++count == 8)
+                    {
+                        bytes.push_back(char(bits));
+                        bits = 0;
+                        count = 0;
+                    }
+                }
+            }
 
-        case kSpecialCases:
-            return special_cases_fill();
-            break;
+            //  Huffman codes go most significant bit first
+            void put_code(uint32_t code, int length)
+            {
+                while (length--)
+                {
+                    put_bits(code >> length, 1);
+                }
+            }
 
-        case kAllDone:
-            break;
+            void flush()
+            {
+                if (count)
+                {
+                    put_bits(0, 8 - count);
+                }
+            }
         };
 
-        return false;
-    }
+        auto make_block = [](int match_count, bool valid_distance)
+        {
+            BitWriter writer;
+            writer.put_bits(1, 1);      // final
+            writer.put_bits(2, 2);      // dynamic Huffman
+            writer.put_bits(29, 5);     // 286 literal/length codes
+            writer.put_bits(0, 5);      // 1 distance code
+            writer.put_bits(14, 4);     // 18 code length codes
+
+            //  Two bits each for code lengths 0, 1, 2, and zero runs (18).
+            //  In the order 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1.
+            const int code_length_lengths[18] = { 0, 0, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 2 };
+            for (int length : code_length_lengths)
+            {
+                writer.put_bits(length, 3);
+            }
 
+            //  The codes are 0: 00, 1: 01, 2: 10, and 18: 11
+            auto zeroes = [&](int count)
+            {
+                writer.put_code(3, 2);
+                writer.put_bits(count - 11, 7);
+            };
+
+            zeroes(97);
+            writer.put_code(2, 2);      // 'a'
+            zeroes(138);
+            zeroes(20);
+            writer.put_code(2, 2);      // end of block
+            writer.put_code(2, 2);      // length 3
+            zeroes(27);
+            writer.put_code(2, 2);      // length 258
+            writer.put_code(1, 2);      // distance 1
+
+            //  The codes are 'a': 00, end: 01, 3: 10, and 258: 11.
+            //  The only distance code is 0, and 1 is invalid.
+            writer.put_code(0, 2);
+            for (int ix = 0; ix < match_count; ++ix)
+            {
+                writer.put_code(3, 2);
+                writer.put_code(0, 1);
+            }
 
-    bool DeflateTester::compress()
-    {
-        static const int mode[] = {
-            ZlibInterface::Raw,
-            ZlibInterface::Zlib,
-            ZlibInterface::Gzip,
+            writer.put_code(2, 2);
+            writer.put_code(valid_distance ? 0 : 1, 1);
+            writer.put_code(1, 2);
+            writer.flush();
+            return writer.bytes;
         };
 
-        ++m_mode;
-        if (m_mode == sizeof mode / sizeof mode[0])
+        const int match_count = 1000;
+        std::vector<char> block = make_block(match_count, true);
+        int err = deflate.decompress(block.data(), block.size(), output);
+        if (err || output.size() != 1 + 258*match_count + 3
+            || std::count(output.begin(), output.end(), 'a') != std::ptrdiff_t(output.size()))
         {
-            m_mode = 0;
+            std::cerr << "Error: Invalid decompress result with a single distance code\n";
+            return false;
         }
 
-        m_compressed_size = 0;
-        m_compressed.clear();
-
-        if (!ZlibInterface::deflate(
-            m_test_data,
-            m_compressed,
-            mode[m_mode] + ZlibInterface::BestCompression))
+        block = make_block(match_count, false);
+        if (deflate.decompress(block.data(), block.size(), output) != DeflateDecompressor::eInvalidInput)
         {
+            std::cerr << "Error: Invalid distance codeword not detected\n";
             return false;
         }
 
-        m_compressed_size = m_compressed.size();
-
+        std::cout << "Block kind test OK\n";
         return true;
     }
 
 
-    bool DeflateTester::compare_performance(int input_size)
+    bool DeflateTester::test_shared_decoder()
     {
-        if (input_size > m_max_size)
+        std::cout << "Shared decoder test\n";
+
+        //  Some dynamic Huffman blocks, and a short input that gets a static one
+        text_like_fill(500000);
+        if (!compress())
         {
-            input_size = m_max_size;
+            return false;
         }
 
-        int64_t own_elapsed_time = 0;
-        int64_t zlib_elapsed_time = 0;
+        std::vector<char> short_data(m_test_data.begin(), m_test_data.begin() + 100);
+        std::vector<char> short_compressed;
+        if (!ZlibInterface::deflate(short_data, short_compressed, ZlibInterface::Zlib + ZlibInterface::BestCompression))
+        {
+            return false;
+        }
 
-        int loop_count = 200;
-        while (loop_count--)
+        const DeflateDecoder decoder;
+        const int thread_count = 4;
+        bool passed[thread_count] = {};
+
+        std::vector<std::thread> threads;
+        for (int ix = 0; ix < thread_count; ++ix)
         {
-            m_test_data.clear();
-            int count = input_size;
-            while (count--)
+            threads.emplace_back([&, ix]()
             {
-                m_test_data.push_back(' ' + (random_bool(30) ? random_int(5) : 0));
-            }
+                std::vector<char> output;
+                std::vector<char> short_output;
+                bool ok = true;
+                for (int round = 0; ok && round < 5; ++round)
+                {
+                    DeflateDecoder::Result result = decoder.decompress(m_compressed.data(), m_compressed.size(), output);
+                    ok = result.ok() && result.input_consumed == m_compressed.size() && output == m_test_data;
 
-            m_mode = 2;
-            compress();
+                    result = decoder.decompress(short_compressed.data(), short_compressed.size(), short_output);
+                    ok = ok && result.ok() && short_output == short_data;
 
-            int64_t start_time = PerformanceTimer::get_timestamp();
-            if (loop_count & 1)
-            {
-                decompress_with_own_code();
-                own_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+                    result = decoder.verify(m_compressed.data(), m_compressed.size());
+                    ok = ok && result.ok();
 
-                decompress_with_zlib();
-                zlib_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
-            }
-            else
-            {
-                decompress_with_zlib();
-                zlib_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+                    result = decoder.decompress_prefix(m_compressed.data(), m_compressed.size(), 1000, output);
+                    ok = ok && result.ok() && result.output_truncated
+                        && std::equal(output.begin(), output.end(), m_test_data.begin()) && output.size() == 1000;
+                }
+
+                passed[ix] = ok;
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
 
-                decompress_with_own_code();
-                own_elapsed_time += PerformanceTimer::get_elapsed_time(start_time);
+        for (int ix = 0; ix < thread_count; ++ix)
+        {
+            if (!passed[ix])
+            {
+                std::cerr << "Error: Invalid decompress result with a shared decoder\n";
+                return false;
             }
         }
 
-        std::cout << "Own:  " << std::setw(8) << own_elapsed_time << " microseconds\n";
-        std::cout << "Zlib: " << std::setw(8) << zlib_elapsed_time << " microseconds\n";
+        //  The error comes back in the result
+        std::vector<char> broken(m_compressed.begin(), m_compressed.end() - 4);
+        std::vector<char> output;
+        DeflateDecoder::Result result = decoder.decompress(broken.data(), broken.size(), output);
+        if (result.ok() || result.error_message == nullptr)
+        {
+            std::cerr << "Error: Shared decoder didn't report a truncated input\n";
+            return false;
+        }
 
+        std::cout << "Shared decoder test OK\n";
         return true;
     }
 
 
-    void DeflateTester::decompress_with_own_code()
+    bool DeflateTester::test_far_distance_codes()
     {
-        DeflateDecompressor deflate;
-
-        const char* input = m_compressed.data();
-        size_t input_size = m_compressed_size;
-
-        deflate.decompress(input, input_size, m_decompressed);
-    }
-
+        std::cout << "Far distance code test\n";
 
-    void DeflateTester::decompress_with_zlib()
-    {
-        const char* input = m_compressed.data();
-        size_t input_size = m_compressed_size;
+        //  A static Huffman block with a literal, and then 255 matches of length
+        //  258 at distance 1. An output with a 64 KiB buffer has to drop the
+        //  oldest data just before the last of them. Then a match of length 3 at
+        //  distance 40000, with distance code 30 and its 14 extra bits.
+        struct BitWriter
+        {
+            std::vector<char> bytes;
+            uint32_t bits = 0;
+            int count = 0;
 
-        ZlibInterface::inflate(input, input_size, m_decompressed);
-    }
+            //  Header fields and extra bits go least significant bit first
+            void put_bits(uint32_t value, int length)
+            {
+                for (int ix = 0; ix < length; ++ix)
+                {
+                    bits |= ((value >> ix) & 1) << count;
+                    if (++count == 8)
+                    {
+                        bytes.push_back(char(bits));
+                        bits = 0;
+                        count = 0;
+                    }
+                }
+            }
 
+            //  Huffman codes go most significant bit first
+            void put_code(uint32_t code, int length)
+            {
+                while (length--)
+                {
+                    put_bits(code >> length, 1);
+                }
+            }
+        };
 
-    int DeflateTester::random_int(int limit)
-    {
-        int result = int(xorshift32() % limit);
-        return result;
-    }
+        BitWriter writer;
+        writer.put_bits(1, 1);              // final
+        writer.put_bits(1, 2);              // static Huffman
+        writer.put_code(0x30 + 'a', 8);     // literal 'a'
+        for (int ix = 0; ix < 255; ++ix)
+        {
+            writer.put_code(0xc5, 8);       // length 258
+            writer.put_code(0, 5);          // distance 1
+        }
 
+        writer.put_code(1, 7);              // length 3
+        writer.put_code(30, 5);             // distance 32769 + extra
+        writer.put_bits(40000 - 32769, 14);
+        writer.put_code(0, 7);              // end of block
+        writer.put_bits(0, 7);
+        const std::vector<char>& stream = writer.bytes;
 
-    int DeflateTester::random_bool(int percent)
-    {
-        if (percent < 1)
+        DeflateDecompressor deflate;
+        int err = deflate.verify(stream.data(), stream.size());
+        if (err != DeflateDecompressor::eInvalidInput)
         {
+            std::cerr << "Error: Distance code 30 not rejected by verify\n";
             return false;
         }
 
-        if (percent >= 100)
+        int fd = ::open("/dev/null", O_WRONLY);
+        if (fd < 0)
         {
-            return true;
+            std::cerr << "Error: Can't open /dev/null\n";
+            return false;
         }
 
-        constexpr uint32_t one_percent = 0xffffffff / 100;
-        uint32_t limit = percent * one_percent;
-        return  xorshift32() < limit;
-    }
-
+        FdOutput output(fd, 64*1024);
+        err = deflate.decompress(stream.data(), stream.size(), output);
+        ::close(fd);
+        if (err != DeflateDecompressor::eInvalidInput)
+        {
+            std::cerr << "Error: Distance code 30 not rejected with FdOutput\n";
+            return false;
+        }
 
-    uint32_t DeflateTester::xorshift32()
-    {
-        // Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs"
-        uint32_t x = m_xorshift32_state;
-        x ^= x << 13;
-        x ^= x >> 17;
-        x ^= x << 5;
-        m_xorshift32_state = x;
-        return x;
-    }
+        //  Exported tokens never have a distance past 32 KiB
+        struct NullConsumer : DeflateDecompressor::TokenConsumer
+        {
+            bool consume(const DeflateDecompressor::TokenBatch& /*batch*/) override { return true; }
+        };
 
-    void DeflateTester::begin_test(const char* name)
-    {
-        if (m_test_data.empty())
+        NullConsumer consumer;
+        err = deflate.tokenize(stream.data(), stream.size(), consumer);
+        if (err != DeflateDecompressor::eInvalidInput)
         {
-            m_test_name = name;
-            std::cout << name << '\n';
+            std::cerr << "Error: Distance code 30 not rejected when tokenizing\n";
+            return false;
         }
+
+        std::cout << "Far distance code test OK\n";
+        return true;
     }
 
 
@@ -560,13 +2734,36 @@ namespace {
     }
 
 
-    bool run_tests()
+    bool run_tests(bool use_counters)
     {
         DeflateTester tester(80*1024);
 
-        tester.compare_performance(75*1024);
-
-        bool result = tester.run_all_tests();
+        tester.compare_performance(75*1024, use_counters);
+        tester.compare_small_block_performance(256*1024, 1024);
+        tester.compare_skip_performance(16*1024*1024);
+        tester.compare_huge_page_performance(32*1024*1024, use_counters);
+        tester.compare_far_match_performance(16*1024*1024);
+
+        bool result = tester.run_all_tests()
+            && tester.test_output_buffers()
+            && tester.test_table_cache()
+            && tester.test_segmented_output()
+            && tester.test_mapped_file_output()
+            && tester.test_fd_stream()
+            && tester.test_decompress_pipeline()
+            && tester.test_token_export()
+            && tester.test_zip_reader()
+            && tester.test_span_input()
+            && tester.test_png_unfilter()
+            && tester.test_trailing_data()
+            && tester.test_prefix_decompress()
+            && tester.test_verify()
+            && tester.test_decompress_range()
+            && tester.test_large_stream()
+            && tester.test_size_hints()
+            && tester.test_block_kinds()
+            && tester.test_shared_decoder()
+            && tester.test_far_distance_codes();
         if (result)
         {
             std::cout << "All tests OK\n";
@@ -578,9 +2775,19 @@ namespace {
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
-    bool ok = run_tests();
+    //  Optionally report hardware performance counters with the timings
+    bool use_counters = false;
+    for (int ix = 1; ix < argc; ++ix)
+    {
+        if (std::strcmp(argv[ix], "--perf-counters") == 0)
+        {
+            use_counters = true;
+        }
+    }
+
+    bool ok = run_tests(use_counters);
 
     return ok ? 0 : 1;
 }
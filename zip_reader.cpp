@@ -0,0 +1,641 @@
+//
+//    Copyright (C) 2020 Martti Ylioja
+//    SPDX-License-Identifier: GPL-3.0-or-later
+//
+#include "zip_reader.h"
+#include "mapped_file_output.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+    constexpr uint32_t local_header_signature = 0x04034b50;
+    constexpr uint32_t central_header_signature = 0x02014b50;
+    constexpr uint32_t end_record_signature = 0x06054b50;
+    constexpr uint32_t zip64_end_record_signature = 0x06064b50;
+    constexpr uint32_t zip64_locator_signature = 0x07064b50;
+
+    //  Sizes of the fixed parts
+    constexpr size_t local_header_size = 30;
+    constexpr size_t central_header_size = 46;
+    constexpr size_t end_record_size = 22;
+    constexpr size_t zip64_locator_size = 20;
+    constexpr size_t zip64_end_record_size = 56;
+
+    //  The end record may be followed by a comment this long
+    constexpr size_t max_comment_size = 0xffff;
+
+    //  Tag of the extra field with the ZIP64 sizes and offset
+    constexpr unsigned zip64_extra_tag = 0x0001;
+
+    constexpr int method_stored = 0;
+    constexpr int method_deflated = 8;
+
+    constexpr int encrypted_flag = 0x0001;
+
+    //  The size in the central directory is only trusted this far for sizing
+    //  an output file up front. Deflate can't expand data more than 1032 times
+    //  anyway. The file grows past the step if the data really is bigger.
+    constexpr uint64_t max_growth_step = 64*1024*1024;
+    constexpr uint64_t max_deflate_ratio = 1032;
+
+    uint16_t get_uint16(const char* ptr)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(ptr);
+        return uint16_t(bytes[0] + (bytes[1] << 8));
+    }
+
+
+    uint32_t get_uint32(const char* ptr)
+    {
+        return get_uint16(ptr) + (uint32_t(get_uint16(ptr + 2)) << 16);
+    }
+
+
+    uint64_t get_uint64(const char* ptr)
+    {
+        return get_uint32(ptr) + (uint64_t(get_uint32(ptr + 4)) << 32);
+    }
+
+
+    //  Pass the data on to another output, computing its CRC-32 on the way
+    class ChecksumOutput : public DeflateDecompressor::Output
+    {
+    public:
+        explicit ChecksumOutput(DeflateDecompressor::Output& output)
+            : m_output(output)
+        {
+        }
+
+        uint32_t crc32() const { return m_crc32; }
+        uint64_t size() const { return m_size; }
+
+        bool start(DeflateDecompressor::Window& window, size_t size_hint) override
+        {
+            m_crc32 = 0;
+            m_size = 0;
+            bool ok = m_output.start(window, size_hint);
+            m_checked = window.next;
+            return ok;
+        }
+
+        bool make_room(DeflateDecompressor::Window& window, size_t needed) override
+        {
+            update(window);
+            bool ok = m_output.make_room(window, needed);
+            m_checked = window.next;
+            return ok;
+        }
+
+        bool finish(DeflateDecompressor::Window& window) override
+        {
+            update(window);
+            return m_output.finish(window);
+        }
+
+    private:
+        void update(const DeflateDecompressor::Window& window)
+        {
+            size_t size = window.next - m_checked;
+            m_crc32 = DeflateDecompressor::crc32(m_crc32, m_checked, size);
+            m_size += size;
+            m_checked = window.next;
+        }
+
+        DeflateDecompressor::Output& m_output;
+        const char* m_checked = nullptr;
+        uint32_t m_crc32 = 0;
+        uint64_t m_size = 0;
+    };
+
+
+    //  Names must stay inside the directory they are extracted to
+    bool is_safe_name(const std::string& name)
+    {
+        if (name.empty() || name[0] == '/')
+        {
+            return false;
+        }
+
+        size_t begin = 0;
+        while (begin <= name.size())
+        {
+            size_t end = name.find_first_of("/\\", begin);
+            if (end == std::string::npos)
+            {
+                end = name.size();
+            }
+
+            if (name.compare(begin, end - begin, "..") == 0)
+            {
+                return false;
+            }
+
+            begin = end + 1;
+        }
+
+        return true;
+    }
+
+
+    //  Create all the directories leading to a path
+    bool make_parent_directories(const std::string& path)
+    {
+        for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1))
+        {
+            std::string directory = path.substr(0, pos);
+            if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    bool write_all(int fd, const char* data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t count = ::write(fd, data, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return false;
+            }
+
+            data += count;
+            size -= size_t(count);
+        }
+
+        return true;
+    }
+
+} // namespace
+
+
+ZipReader::~ZipReader()
+{
+    close();
+}
+
+
+bool ZipReader::open(const char* path)
+{
+    close();
+    m_error_message = nullptr;
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || ::fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        m_error_message = "Can't open the ZIP archive";
+        return false;
+    }
+
+    m_size = size_t(info.st_size);
+    void* mapping = m_size ? ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        m_size = 0;
+        m_error_message = "Can't map the ZIP archive";
+        return false;
+    }
+
+    m_data = static_cast<const char*>(mapping);
+    if (!read_central_directory())
+    {
+        const char* message = m_error_message;
+        close();
+        m_error_message = message;
+        return false;
+    }
+
+    return true;
+}
+
+
+void ZipReader::close()
+{
+    if (m_data)
+    {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_entries.clear();
+    m_index.clear();
+}
+
+
+const ZipReader::Entry* ZipReader::find(const std::string& name) const
+{
+    auto it = m_index.find(name);
+    if (it == m_index.end())
+    {
+        return nullptr;
+    }
+
+    return &m_entries[it->second];
+}
+
+
+bool ZipReader::read_central_directory()
+{
+    if (m_size < end_record_size)
+    {
+        m_error_message = "Not a ZIP archive";
+        return false;
+    }
+
+    //  The end record is last, but a comment of unknown size may follow it
+    size_t lowest = (m_size > end_record_size + max_comment_size) ? m_size - end_record_size - max_comment_size : 0;
+    size_t end_offset = m_size - end_record_size + 1;
+    do
+    {
+        if (end_offset-- == lowest)
+        {
+            m_error_message = "Not a ZIP archive";
+            return false;
+        }
+    }
+    while (get_uint32(m_data + end_offset) != end_record_signature);
+
+    const char* end_record = m_data + end_offset;
+    uint32_t disk = get_uint16(end_record + 4);
+    uint32_t directory_disk = get_uint16(end_record + 6);
+    uint64_t entry_count = get_uint16(end_record + 10);
+    uint64_t directory_size = get_uint32(end_record + 12);
+    uint64_t directory_offset = get_uint32(end_record + 16);
+
+    //  Values that don't fit are in the ZIP64 end record
+    if (entry_count == 0xffff || directory_size == 0xffffffff || directory_offset == 0xffffffff)
+    {
+        const char* locator = end_record - zip64_locator_size;
+        if (end_offset < zip64_locator_size || get_uint32(locator) != zip64_locator_signature)
+        {
+            m_error_message = "Missing ZIP64 end of central directory locator";
+            return false;
+        }
+
+        uint64_t record_offset = get_uint64(locator + 8);
+        if (m_size < zip64_end_record_size || record_offset > m_size - zip64_end_record_size
+            || get_uint32(m_data + record_offset) != zip64_end_record_signature)
+        {
+            m_error_message = "Invalid ZIP64 end of central directory record";
+            return false;
+        }
+
+        const char* record = m_data + record_offset;
+        disk = get_uint32(record + 16);
+        directory_disk = get_uint32(record + 20);
+        entry_count = get_uint64(record + 32);
+        directory_size = get_uint64(record + 40);
+        directory_offset = get_uint64(record + 48);
+    }
+
+    if (disk != 0 || directory_disk != 0)
+    {
+        m_error_message = "ZIP archives split across files aren't supported";
+        return false;
+    }
+
+    //  Every entry takes at least the fixed size, so a bogus count can't allocate much
+    if (directory_offset > m_size || directory_size > m_size - directory_offset
+        || entry_count > directory_size / central_header_size)
+    {
+        m_error_message = "Invalid ZIP central directory";
+        return false;
+    }
+
+    m_entries.reserve(size_t(entry_count));
+    m_index.reserve(size_t(entry_count));
+
+    const char* header = m_data + directory_offset;
+    const char* directory_end = header + directory_size;
+    for (uint64_t ix = 0; ix < entry_count; ++ix)
+    {
+        if (size_t(directory_end - header) < central_header_size || get_uint32(header) != central_header_signature)
+        {
+            m_error_message = "Invalid ZIP central directory entry";
+            return false;
+        }
+
+        size_t name_size = get_uint16(header + 28);
+        size_t extra_size = get_uint16(header + 30);
+        size_t comment_size = get_uint16(header + 32);
+        size_t total_size = central_header_size + name_size + extra_size + comment_size;
+        if (size_t(directory_end - header) < total_size)
+        {
+            m_error_message = "Invalid ZIP central directory entry";
+            return false;
+        }
+
+        Entry entry;
+        entry.encrypted = (get_uint16(header + 8) & encrypted_flag) != 0;
+        entry.method = get_uint16(header + 10);
+        entry.crc32 = get_uint32(header + 16);
+        entry.compressed_size = get_uint32(header + 20);
+        entry.uncompressed_size = get_uint32(header + 24);
+        entry.local_header_offset = get_uint32(header + 42);
+        entry.name.assign(header + central_header_size, name_size);
+
+        //  The ZIP64 extra field has the values that don't fit, in this order
+        const char* extra = header + central_header_size + name_size;
+        const char* extra_end = extra + extra_size;
+        while (extra_end - extra >= 4)
+        {
+            unsigned tag = get_uint16(extra);
+            size_t size = get_uint16(extra + 2);
+            const char* field = extra + 4;
+            if (size_t(extra_end - field) < size)
+            {
+                break;
+            }
+
+            if (tag == zip64_extra_tag)
+            {
+                const char* field_end = field + size;
+                for (uint64_t* value : { &entry.uncompressed_size, &entry.compressed_size, &entry.local_header_offset })
+                {
+                    if (*value == 0xffffffff && field_end - field >= 8)
+                    {
+                        *value = get_uint64(field);
+                        field += 8;
+                    }
+                }
+            }
+
+            extra += 4 + size;
+        }
+
+        //  The first of duplicate names wins
+        m_index.emplace(entry.name, m_entries.size());
+        m_entries.push_back(std::move(entry));
+        header += total_size;
+    }
+
+    return true;
+}
+
+
+const char* ZipReader::entry_data(const Entry& entry) const
+{
+    uint64_t offset = entry.local_header_offset;
+    if (offset > m_size || m_size - offset < local_header_size)
+    {
+        return nullptr;
+    }
+
+    const char* header = m_data + offset;
+    if (get_uint32(header) != local_header_signature)
+    {
+        return nullptr;
+    }
+
+    //  The sizes in the local header may be missing, so use the central directory's
+    uint64_t data_offset = offset + local_header_size + get_uint16(header + 26) + get_uint16(header + 28);
+    if (data_offset > m_size || entry.compressed_size > m_size - data_offset)
+    {
+        return nullptr;
+    }
+
+    return m_data + data_offset;
+}
+
+
+int ZipReader::report(int err, const char* message)
+{
+    m_error_message = message;
+    return err;
+}
+
+
+int ZipReader::extract(const Entry& entry, std::vector<char>& out, DeflateDecompressor& deflate)
+{
+    m_error_message = nullptr;
+    out.clear();
+
+    if (entry.encrypted || (entry.method != method_stored && entry.method != method_deflated))
+    {
+        return report(DeflateDecompressor::eInvalidInput, "Unsupported ZIP entry");
+    }
+
+    const char* data = entry_data(entry);
+    if (!data)
+    {
+        return report(DeflateDecompressor::eInvalidInput, "Invalid ZIP local header");
+    }
+
+    if (entry.method == method_stored)
+    {
+        out.assign(data, data + entry.compressed_size);
+    }
+    else
+    {
+        int err = deflate.decompress(data, size_t(entry.compressed_size), out);
+        if (err)
+        {
+            return report(err, deflate.error_message());
+        }
+    }
+
+    if (out.size() != entry.uncompressed_size
+        || DeflateDecompressor::crc32(0, out.data(), out.size()) != entry.crc32)
+    {
+        return report(DeflateDecompressor::eChecksum, "ZIP entry CRC-32 or size mismatch");
+    }
+
+    return DeflateDecompressor::eSuccess;
+}
+
+
+int ZipReader::extract(const std::string& name, std::vector<char>& out)
+{
+    const Entry* entry = find(name);
+    if (!entry)
+    {
+        out.clear();
+        return report(DeflateDecompressor::eInvalidInput, "No such entry in the ZIP archive");
+    }
+
+    return extract(*entry, out, DeflateDecompressor::thread_instance());
+}
+
+
+bool ZipReader::extract_all(const std::string& directory, int thread_count)
+{
+    m_error_message = nullptr;
+    if (thread_count <= 0)
+    {
+        thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+
+    //  The threads take the entries in turn. Only the first problem is reported.
+    std::atomic<size_t> next_entry(0);
+    std::mutex mutex;
+    bool all_ok = true;
+
+    auto work = [&]()
+    {
+        DeflateDecompressor& deflate = DeflateDecompressor::thread_instance();
+        for (size_t ix = next_entry++; ix < m_entries.size(); ix = next_entry++)
+        {
+            //  Of entries with the same name, only the one find returns gets
+            //  extracted. Two threads must never write the same file.
+            const Entry& entry = m_entries[ix];
+            if (m_index.at(entry.name) != ix)
+            {
+                continue;
+            }
+
+            const char* message = nullptr;
+            int err = extract_to_file(entry, directory + '/' + entry.name, deflate, message);
+            if (err)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (all_ok)
+                {
+                    m_error_message = message;
+                    all_ok = false;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int ix = 1; ix < thread_count; ++ix)
+    {
+        threads.emplace_back(work);
+    }
+
+    work();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    return all_ok;
+}
+
+
+//  Called from several threads at once, so nothing here changes the object
+int ZipReader::extract_to_file(
+    const Entry& entry, const std::string& path, DeflateDecompressor& deflate, const char*& message) const
+{
+    if (!is_safe_name(entry.name))
+    {
+        message = "Unsafe ZIP entry name";
+        return DeflateDecompressor::eInvalidInput;
+    }
+
+    if (!make_parent_directories(path))
+    {
+        message = "Can't create a directory for a ZIP entry";
+        return DeflateDecompressor::eOutputError;
+    }
+
+    if (entry.is_directory())
+    {
+        if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            message = "Can't create a directory for a ZIP entry";
+            return DeflateDecompressor::eOutputError;
+        }
+
+        return DeflateDecompressor::eSuccess;
+    }
+
+    if (entry.encrypted || (entry.method != method_stored && entry.method != method_deflated))
+    {
+        message = "Unsupported ZIP entry";
+        return DeflateDecompressor::eInvalidInput;
+    }
+
+    const char* data = entry_data(entry);
+    if (!data)
+    {
+        message = "Invalid ZIP local header";
+        return DeflateDecompressor::eInvalidInput;
+    }
+
+    uint32_t crc32 = 0;
+    uint64_t size = 0;
+    if (entry.method == method_stored)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write_all(fd, data, size_t(entry.compressed_size));
+        if (fd >= 0 && ::close(fd) != 0)
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            message = "Writing a ZIP entry failed";
+            return DeflateDecompressor::eOutputError;
+        }
+
+        crc32 = DeflateDecompressor::crc32(0, data, size_t(entry.compressed_size));
+        size = entry.compressed_size;
+    }
+    else
+    {
+        //  Map the whole file at once, since its size is known
+        MappedFileOutput file;
+        uint64_t step = std::min(entry.uncompressed_size, max_growth_step);
+        step = std::min(step, entry.compressed_size*max_deflate_ratio);
+        file.set_growth_step(size_t(step) + 4096);
+        if (!file.open(path.c_str()))
+        {
+            message = "Writing a ZIP entry failed";
+            return DeflateDecompressor::eOutputError;
+        }
+
+        ChecksumOutput output(file);
+        int err = deflate.decompress(data, size_t(entry.compressed_size), output);
+        if (!file.close() && !err)
+        {
+            err = DeflateDecompressor::eOutputError;
+        }
+
+        if (err)
+        {
+            message = deflate.error_message() ? deflate.error_message() : "Writing a ZIP entry failed";
+            return err;
+        }
+
+        crc32 = output.crc32();
+        size = output.size();
+    }
+
+    if (size != entry.uncompressed_size || crc32 != entry.crc32)
+    {
+        message = "ZIP entry CRC-32 or size mismatch";
+        return DeflateDecompressor::eChecksum;
+    }
+
+    return DeflateDecompressor::eSuccess;
+}
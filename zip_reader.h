@@ -0,0 +1,86 @@
+/*
+    Copyright (C) 2020 Martti Ylioja
+    SPDX-License-Identifier: GPL-3.0-or-later
+*/
+#pragma once
+
+#include "deflate_decompressor.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//  Read ZIP archives, including ZIP64 ones.
+//
+//  The archive is memory mapped, and only its central directory is parsed
+//  when it's opened. Extracting an entry reads just that entry. Deflated
+//  entries are raw deflate data, decoded straight from the mapping. The
+//  CRC-32 and the size of every entry are checked.
+//
+//  Encrypted entries, compression methods other than stored and deflated,
+//  and archives split across several files aren't supported.
+//
+//  Available on POSIX systems only.
+//
+class ZipReader
+{
+public:
+    struct Entry
+    {
+        std::string name;
+        int method = 0;
+        uint32_t crc32 = 0;
+        uint64_t compressed_size = 0;
+        uint64_t uncompressed_size = 0;
+        uint64_t local_header_offset = 0;
+        bool encrypted = false;
+
+        bool is_directory() const { return !name.empty() && name.back() == '/'; }
+    };
+
+    ZipReader() = default;
+    ~ZipReader();
+
+    ZipReader(const ZipReader&) = delete;
+    ZipReader& operator=(const ZipReader&) = delete;
+
+    //  Map the archive and read its central directory
+    bool open(const char* path);
+    void close();
+
+    const std::vector<Entry>& entries() const { return m_entries; }
+
+    //  Returns nullptr if there's no entry with the name
+    const Entry* find(const std::string& name) const;
+
+    //  Extract a single entry into memory. Returns one of the DeflateDecompressor
+    //  error codes, with eChecksum for a CRC-32 or size mismatch.
+    int extract(const Entry& entry, std::vector<char>& out, DeflateDecompressor& deflate);
+    int extract(const std::string& name, std::vector<char>& out);
+
+    //  Extract all entries as files under a directory, using a number of threads.
+    //  Zero threads means one per hardware thread. Returns true if all succeeded.
+    //  Of entries with the same name, only the one find returns is extracted.
+    bool extract_all(const std::string& directory, int thread_count = 0);
+
+    //  A brief description of the last problem
+    const char* error_message() const { return m_error_message; }
+
+private:
+    bool read_central_directory();
+
+    //  The data of an entry inside the mapping, or nullptr if the local header is broken
+    const char* entry_data(const Entry& entry) const;
+
+    int extract_to_file(const Entry& entry, const std::string& path,
+        DeflateDecompressor& deflate, const char*& message) const;
+    int report(int err, const char* message);
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+
+    std::vector<Entry> m_entries;
+    std::unordered_map<std::string, size_t> m_index;
+
+    const char* m_error_message = nullptr;
+};
@@ -8,15 +8,30 @@
 
 namespace ZlibInterface {
 
-    bool deflate(const std::vector<char>& input, std::vector<char>& output, int mode_and_level)
+    bool deflate(const std::vector<char>& input, std::vector<char>& output, int mode_and_level, size_t flush_interval)
     {
         z_stream zs;
         zs.zalloc = Z_NULL;
         zs.zfree = Z_NULL;
         zs.opaque = Z_NULL;
-        zs.avail_in = input.size();
+        zs.avail_in = 0;
         zs.next_in = (Bytef*)input.data();
 
+        //  Input not yet given to zlib
+        size_t remaining = input.size();
+        auto feed_input = [&]() {
+            size_t piece = remaining;
+            if (flush_interval && piece > flush_interval)
+            {
+                piece = flush_interval;
+            }
+
+            zs.avail_in = piece;
+            remaining -= piece;
+        };
+
+        feed_input();
+
         gz_header header;
         header.text = 0;
         header.time = 0x01020304;
@@ -44,13 +59,23 @@ namespace ZlibInterface {
             level = Z_BEST_COMPRESSION;
         }
 
+        int strategy = Z_DEFAULT_STRATEGY;
+        if (mode_and_level & HuffmanOnly)
+        {
+            strategy = Z_HUFFMAN_ONLY;
+        }
+        else if (mode_and_level & RunLengths)
+        {
+            strategy = Z_RLE;
+        }
+
         int ret = deflateInit2(
             &zs,
             level,
             Z_DEFLATED,
             window_bits,
             8,
-            Z_DEFAULT_STRATEGY
+            strategy
         );
 
         if (ret != Z_OK)
@@ -72,7 +97,24 @@ namespace ZlibInterface {
             zs.avail_out = chunk_size;
             zs.next_out = buffer;
 
-            ret = ::deflate(&zs, zs.avail_in ? Z_NO_FLUSH : Z_FINISH);
+            int flush = Z_FINISH;
+            if (zs.avail_in)
+            {
+                flush = Z_NO_FLUSH;
+            }
+            else if (remaining)
+            {
+                flush = Z_SYNC_FLUSH;
+            }
+
+            ret = ::deflate(&zs, flush);
+
+            //  The flush is complete when it leaves some output space unused
+            if (flush == Z_SYNC_FLUSH && zs.avail_out != 0)
+            {
+                feed_input();
+            }
+
             switch (ret)
             {
             case Z_STREAM_END:
@@ -82,6 +124,14 @@ namespace ZlibInterface {
             case Z_OK:
                 break;
 
+            //  A repeated flush with nothing left to flush. Not an error.
+            case Z_BUF_ERROR:
+                if (flush != Z_SYNC_FLUSH)
+                {
+                    state = State::Error;
+                }
+                break;
+
             default:
                 state = State::Error;
                 break;
@@ -115,7 +165,8 @@ namespace ZlibInterface {
         zs.avail_in = size;
         zs.next_in = (Bytef*)input;
 
-        int ret = inflateInit(&zs);
+        //  Accept both zlib and gzip headers
+        int ret = inflateInit2(&zs, 15 + 32);
         if (ret != Z_OK)
         {
             return false;
@@ -4,6 +4,7 @@
 */
 #pragma once
 
+#include <cstddef>
 #include <vector>
 
 namespace ZlibInterface {
@@ -20,11 +21,22 @@ namespace ZlibInterface {
         BestSpeed = 1,
         BestCompression = 9,
 
+        //  Compression strategies (optional)
+        //
+        HuffmanOnly = 0x0010,
+        RunLengths = 0x0020,
+
         //  This is the default combination
         Default = Zlib + BestCompression
     };
 
-    bool deflate(const std::vector<char>& input, std::vector<char>& output, int mode_and_level = Default);
+    //  A nonzero flush_interval ends the current block with a Z_SYNC_FLUSH
+    //  after every flush_interval bytes of input.
+    bool deflate(
+        const std::vector<char>& input,
+        std::vector<char>& output,
+        int mode_and_level = Default,
+        size_t flush_interval = 0);
 
     bool inflate(const char* input, size_t size, std::vector<char>& output);
 }